@@ -0,0 +1,75 @@
+/* Counts heap allocations, for the tests and benchmarks that check a loop
+makes none per item once it is warmed up. It replaces the global operator
+new and delete, so include it in exactly one source file of a program, and
+read num_allocations before and after the code being measured. */
+
+#ifndef ALLOC_COUNT_H
+#define ALLOC_COUNT_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Allocations made through operator new since the program started
+inline std::atomic<size_t> num_allocations{0};
+
+void *operator new(size_t size) {
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    if(void *p = malloc(size > 0 ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = nullptr;
+    if(posix_memalign(&p, size_t(align) < sizeof(void *) ? sizeof(void *) : size_t(align),
+                      size > 0 ? size : 1) == 0) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void *operator new[](size_t size, std::align_val_t align) {
+    return operator new(size, align);
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept {
+    free(p);
+}
+
+void operator delete[](void *p, size_t, std::align_val_t) noexcept {
+    free(p);
+}
+
+#endif
@@ -0,0 +1,80 @@
+/* Checks that the training and testing loops make no heap allocations per
+row once they are warmed up. Each case runs main.exe's code in-process (see
+run_classifier.h) on a file of some rows, then on one twice as long that
+repeats the same posts, and both runs must allocate exactly as often: every allocation is warm-up or per-file, none per row.
+Build and run with make test. */
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "alloc_count.h"
+#include "run_classifier.h"
+
+using namespace std;
+
+// Distinct posts the files cycle through. It divides the test loop's batch
+// size, so each batch slot always holds the same post.
+const size_t NUM_POSTS = 32;
+const size_t NUM_ROWS = 2048; // more than one test batch
+
+// RETURNS: -
+// EFFECTS: writes a CSV of num_rows posts, cycling through NUM_POSTS
+//          distinct posts over 5 labels and 60 words
+// MODIFIES: the file at path
+void write_cycling_posts(const string &path, size_t num_rows) {
+    write_posts(path, num_rows, [](ostream &out, size_t row) {
+        size_t post = row % NUM_POSTS;
+        out << "tag" << post % 5 << ",";
+        for(size_t k = 0; k < 2 + post % 9; k++) {
+            out << (k > 0 ? " " : "") << "word" << (post * 7 + k * 11) % 60;
+        }
+    });
+}
+
+// RETURNS: the allocations made by running main.exe with args, with its
+//          output discarded
+size_t count_allocations(vector<string> args) {
+    size_t before = num_allocations.load();
+    run_classifier(args);
+    return num_allocations.load() - before;
+}
+
+// RETURNS: true if main.exe allocates as often on the long file as on the
+//          short one, with the file's name in args replaced by each
+// EFFECTS: prints the counts
+bool check_steady(const string &name, vector<string> args, size_t file_arg,
+                  const string &short_file, const string &long_file) {
+    args[file_arg] = short_file;
+    size_t short_count = count_allocations(args);
+    args[file_arg] = long_file;
+    size_t long_count = count_allocations(args);
+    bool steady = short_count == long_count;
+    cout << name << ": " << short_count << " allocations for " << NUM_ROWS << " rows, "
+        << long_count << " for " << 2 * NUM_ROWS << " rows"
+        << (steady ? "" : " -- FAILED, some rows allocate") << endl;
+    return steady;
+}
+
+int main() {
+    string dir = temp_dir();
+    string one_pass = dir + "/alloc_test_posts.csv";
+    string short_file = dir + "/alloc_test_short.csv";
+    string long_file = dir + "/alloc_test_long.csv";
+    write_cycling_posts(one_pass, NUM_POSTS);
+    write_cycling_posts(short_file, NUM_ROWS);
+    write_cycling_posts(long_file, 2 * NUM_ROWS);
+
+    bool ok = check_steady("serial train", {"main.exe", "", one_pass}, 1,
+                           short_file, long_file);
+    ok = check_steady("test", {"main.exe", one_pass, ""}, 2,
+                      short_file, long_file) && ok;
+    ok = check_steady("--window", {"main.exe", "", one_pass, "--online", "--window", "16"}, 1,
+                      short_file, long_file) && ok;
+
+    remove(one_pass.c_str());
+    remove(short_file.c_str());
+    remove(long_file.c_str());
+    cout << (ok ? "PASS" : "FAIL") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,226 @@
+/* Measures the memory and time of the vocabulary on a large synthetic
+corpus, against the allocator it replaced: one std::string per word in a
+deque, indexed by an unordered_map of string_views (StringVocabulary
+below, as vocabulary.h was before it packed strings into blocks). Each
+interns the unique words of every post in its own child process, and the
+benchmark prints the time to intern and to free them and how far each
+child's resident memory grew. It then trains main.exe's code in-process
+(see run_classifier.h) on the same corpus, in a child as well, and prints
+the training time and peak RSS --timing reports.
+
+The corpus has 200 labels and, in its 200,000 posts by default, about 1.2
+million distinct words: mostly common words, and one in six a random
+string, like the hashes and URLs in real posts.
+
+Usage: bench_memory.exe [NUM_POSTS [CORPUS_FILE]]
+With a CORPUS_FILE, the corpus is written there and kept, so an older
+main.exe can be timed on it with main.exe CORPUS_FILE --save-model
+/dev/null --timing. */
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "run_classifier.h"
+#include "tokenizer.h"
+#include "vocabulary.h"
+
+using namespace std;
+
+// Interns strings the way Vocabulary did before it packed them into blocks
+class StringVocabulary {
+    private:
+    deque<string> names;
+    unordered_map<string_view, uint32_t> ids; // <string, ID>
+
+    public:
+    // RETURNS: the ID of str, assigning the next unused ID if str is new
+    // MODIFIES: names, ids
+    uint32_t intern(string_view str) {
+        auto it = ids.find(str);
+        if(it != ids.end()) {
+            return it->second;
+        }
+        uint32_t id = uint32_t(names.size());
+        names.emplace_back(str);
+        ids.emplace(names[id], id);
+        return id;
+    }
+
+    size_t size() const {
+        return ids.size();
+    }
+};
+
+// Makes the corpus's posts, the same ones every time
+class Corpus {
+    private:
+    mt19937 random{1};
+
+    public:
+    // RETURNS: -
+    // EFFECTS: sets tag and content to the next post
+    // MODIFIES: tag, content
+    void next(string &tag, string &content) {
+        tag = "label" + to_string(random() % 200);
+        content.clear();
+        size_t num_words = 10 + random() % 51;
+        for(size_t i = 0; i < num_words; i++) {
+            if(i > 0) {
+                content += ' ';
+            }
+            if(random() % 6 == 0) {
+                size_t length = 6 + random() % 10;
+                for(size_t c = 0; c < length; c++) {
+                    content += char('a' + random() % 26);
+                }
+            }
+            else {
+                content += "w" + to_string(random() % (1 + random() % 50000));
+            }
+        }
+    }
+};
+
+double peak_rss_mb(); // in main.cpp
+
+struct Measurement {
+    double build_ms = -1;
+    double free_ms = -1;
+    double rss_mb = -1; // growth of the peak RSS
+    size_t num_words = 0;
+};
+
+// RETURNS: what measure() returns, run in a child process so the memory
+//          each measurement uses starts from the same baseline
+template<typename Measure>
+Measurement in_child(Measure measure) {
+    int fds[2];
+    Measurement result;
+    if(pipe(fds) != 0) {
+        return result;
+    }
+    cout.flush();
+    pid_t child = fork();
+    if(child == 0) {
+        close(fds[0]);
+        Measurement measured = measure();
+        ssize_t written = write(fds[1], &measured, sizeof(measured));
+        _exit(written == ssize_t(sizeof(measured)) ? 0 : 1);
+    }
+    close(fds[1]);
+    if(child > 0 && read(fds[0], &result, sizeof(result)) != ssize_t(sizeof(result))) {
+        result = Measurement();
+    }
+    close(fds[0]);
+    if(child > 0) {
+        waitpid(child, nullptr, 0);
+    }
+    return result;
+}
+
+// RETURNS: the time and memory to intern the unique words of num_posts
+//          posts of the corpus into a new Vocab, and to free it
+template<typename Vocab>
+Measurement measure_vocabulary(size_t num_posts) {
+    Corpus corpus;
+    string tag;
+    string content;
+    vector<string_view> words;
+    Measurement result;
+    double start_rss = peak_rss_mb();
+    double build_ms = 0;
+    auto *vocabulary = new Vocab();
+    for(size_t post = 0; post < num_posts; post++) {
+        corpus.next(tag, content);
+        auto start = chrono::steady_clock::now();
+        split_unique_words(content, words);
+        for(string_view word : words) {
+            vocabulary->intern(word);
+        }
+        build_ms += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    }
+    result.build_ms = build_ms;
+    result.num_words = vocabulary->size();
+    result.rss_mb = peak_rss_mb() - start_rss;
+    auto start = chrono::steady_clock::now();
+    delete vocabulary;
+    result.free_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+// RETURNS: the training time and peak RSS main.exe reports with --timing
+//          when it trains on train_file
+Measurement measure_training(const string &train_file, const string &dir) {
+    string model_file = dir + "/bench_memory.model";
+    string timing_file = dir + "/bench_memory.timing";
+    vector<string> args = {"main.exe", train_file, "--save-model", model_file, "--timing"};
+    Measurement result;
+    if(run_classifier(args, timing_file) == 0) {
+        // "timing: train X ms, finalize (log tables) Y ms, test Z ms, peak RSS R MB"
+        string report = read_file(timing_file);
+        istringstream in(report);
+        string word;
+        in >> word >> word >> result.build_ms;
+        size_t rss = report.find("peak RSS ");
+        if(rss != string::npos) {
+            result.rss_mb = strtod(report.c_str() + rss + 9, nullptr);
+        }
+    }
+    remove(model_file.c_str());
+    remove(timing_file.c_str());
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    size_t num_posts = argc > 1 ? strtoul(argv[1], nullptr, 10) : 200000;
+    string dir = temp_dir();
+    string train_file = argc > 2 ? argv[2] : dir + "/bench_memory_posts.csv";
+    Corpus corpus;
+    write_posts(train_file, num_posts, [&](ostream &out, size_t) {
+        string tag;
+        string content;
+        corpus.next(tag, content);
+        out << tag << "," << content;
+    });
+
+    Measurement strings = in_child([&] {
+        return measure_vocabulary<StringVocabulary>(num_posts);
+    });
+    Measurement blocks = in_child([&] {
+        return measure_vocabulary<Vocabulary>(num_posts);
+    });
+    Measurement training = in_child([&] {
+        return measure_training(train_file, dir);
+    });
+    if(argc <= 2) {
+        remove(train_file.c_str());
+    }
+
+    bool ok = strings.build_ms >= 0 && blocks.build_ms >= 0 && training.build_ms >= 0 &&
+        strings.num_words == blocks.num_words;
+    cout << num_posts << " posts, " << blocks.num_words << " distinct words" << endl;
+    cout << fixed << setprecision(1);
+    cout << "string per word:   intern " << strings.build_ms << " ms, free " << strings.free_ms
+        << " ms, RSS +" << strings.rss_mb << " MB" << endl;
+    cout << "Vocabulary blocks: intern " << blocks.build_ms << " ms, free " << blocks.free_ms
+        << " ms, RSS +" << blocks.rss_mb << " MB" << endl;
+    cout << "training:          train " << training.build_ms << " ms, peak RSS "
+        << training.rss_mb << " MB" << endl;
+    if(!ok) {
+        cout << "FAIL: a measurement failed" << endl;
+        return 1;
+    }
+    return 0;
+}
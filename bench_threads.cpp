@@ -0,0 +1,92 @@
+/* Benchmarks sharded training (--threads N) from 1 to 64 threads. Each run
+trains main.exe's code in-process (see run_classifier.h) on the same file
+and saves its model; the benchmark prints the training time --timing
+reports for each thread count and its speedup over one thread, and fails
+if any model differs from the serial one by a single byte.
+
+Usage: bench_threads.exe [TRAIN_FILE]
+With no file, it trains on 400,000 generated posts. */
+
+#include <cstdio>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "run_classifier.h"
+
+using namespace std;
+
+// RETURNS: -
+// EFFECTS: writes a CSV of num_posts posts over 200 labels and 50,000 words
+// MODIFIES: the file at path
+void write_random_posts(const string &path, size_t num_posts) {
+    mt19937 random(1);
+    write_posts(path, num_posts, [&](ostream &out, size_t) {
+        out << "label" << random() % 200 << ",";
+        size_t num_words = 5 + random() % 40;
+        for(size_t i = 0; i < num_words; i++) {
+            out << (i > 0 ? " " : "") << "word" << random() % (1 + random() % 50000);
+        }
+    });
+}
+
+// RETURNS: the training time main.exe reports with --timing, in ms, or -1
+//          if it fails
+// EFFECTS: trains on train_file with num_threads threads and saves the
+//          model to model_file, discarding the output
+double train_ms(const string &train_file, size_t num_threads, const string &model_file,
+                const string &timing_file) {
+    vector<string> args = {"main.exe", train_file, "--threads", to_string(num_threads),
+                           "--save-model", model_file, "--timing"};
+    int status = run_classifier(args, timing_file);
+
+    // "timing: train X ms, ..."
+    istringstream report(read_file(timing_file));
+    string word;
+    double ms = -1;
+    report >> word >> word >> ms;
+    return status == 0 && word == "train" ? ms : -1;
+}
+
+int main(int argc, char *argv[]) {
+    string dir = temp_dir();
+    string train_file = argc > 1 ? argv[1] : dir + "/bench_threads_posts.csv";
+    if(argc == 1) {
+        write_random_posts(train_file, 400000);
+    }
+    string model_file = dir + "/bench_threads.model";
+    string timing_file = dir + "/bench_threads.timing";
+
+    cout << "threads  train ms  speedup  model" << endl;
+    string serial_model;
+    double serial_ms = 0;
+    bool ok = true;
+    for(size_t num_threads = 1; num_threads <= 64; num_threads *= 2) {
+        double ms = train_ms(train_file, num_threads, model_file, timing_file);
+        if(ms < 0) {
+            cout << "FAIL: training with " << num_threads << " threads failed" << endl;
+            ok = false;
+            break;
+        }
+        string model = read_file(model_file);
+        if(num_threads == 1) {
+            serial_model = model;
+            serial_ms = ms;
+        }
+        bool identical = model == serial_model;
+        ok = ok && identical;
+        // classifier_main sets its own precision on cout
+        cout << fixed << setprecision(1) << setw(7) << num_threads << "  " << setw(8) << ms << "  " << setw(6)
+            << setprecision(2) << serial_ms / ms << "x  " << (identical ? "identical" : "DIFFERENT") << endl;
+    }
+
+    if(argc == 1) {
+        remove(train_file.c_str());
+    }
+    remove(model_file.c_str());
+    remove(timing_file.c_str());
+    cout << (ok ? "PASS" : "FAIL") << endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/* Benchmarks split_unique_words against the istringstream and set<string>
+tokenizer it replaced. Both run over the same generated posts, which mix
+spaces, tabs, newlines, repeated words and long words; the benchmark checks
+they find the same unique words in the same order, times each, and counts
+the allocations each makes per post once warmed up. It fails if
+split_unique_words allocates at all after its first pass.
+
+Usage: bench_tokenizer.exe [NUM_POSTS] */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <math.h>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "alloc_count.h"
+#include "tokenizer.h"
+
+using namespace std;
+
+// RETURNS: the unique words of str, as the classifier first found them
+set<string> unique_words_stream(const string &str) {
+    istringstream source(str);
+    set<string> words;
+    string word;
+    while(source >> word) {
+        words.insert(word);
+    }
+    return words;
+}
+
+// RETURNS: num_posts posts of 5 to 80 words from a vocabulary of 5000,
+//          separated by runs of assorted whitespace
+vector<string> make_posts(size_t num_posts) {
+    mt19937 random(1);
+    const char spaces[] = " \t\n\v\f\r";
+    vector<string> posts(num_posts);
+    for(string &post : posts) {
+        size_t num_words = 5 + random() % 76;
+        for(size_t i = 0; i < num_words; i++) {
+            size_t gap = i == 0 ? random() % 2 : 1 + random() % 3;
+            for(size_t g = 0; g < gap; g++) {
+                post += random() % 4 == 0 ? spaces[random() % 6] : ' ';
+            }
+            // Zipf-like: most words are common, and some are long
+            size_t word = size_t(5000 * pow(double(random() % 1000 + 1) / 1000, 3));
+            post += "w" + to_string(word);
+            if(random() % 20 == 0) {
+                post += string(20 + random() % 40, char('a' + random() % 26));
+            }
+        }
+    }
+    return posts;
+}
+
+int main(int argc, char *argv[]) {
+    size_t num_posts = argc > 1 ? strtoul(argv[1], nullptr, 10) : 100000;
+    vector<string> posts = make_posts(num_posts);
+
+    // Same words, in the same order
+    vector<string_view> words;
+    size_t total_words = 0;
+    for(const string &post : posts) {
+        set<string> expected = unique_words_stream(post);
+        split_unique_words(post, words);
+        if(!equal(words.begin(), words.end(), expected.begin(), expected.end())) {
+            cout << "FAIL: tokenizers disagree on \"" << post << "\"" << endl;
+            return 1;
+        }
+        total_words += words.size();
+    }
+
+    // Second passes, so only steady-state allocations are counted
+    size_t stream_words = 0;
+    size_t before = num_allocations.load();
+    auto start = chrono::steady_clock::now();
+    for(const string &post : posts) {
+        stream_words += unique_words_stream(post).size();
+    }
+    double stream_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    size_t stream_allocations = num_allocations.load() - before;
+
+    size_t split_words = 0;
+    before = num_allocations.load();
+    start = chrono::steady_clock::now();
+    for(const string &post : posts) {
+        split_unique_words(post, words);
+        split_words += words.size();
+    }
+    double split_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+    size_t split_allocations = num_allocations.load() - before;
+
+    if(stream_words != total_words || split_words != total_words) {
+        cout << "FAIL: a second pass found different words" << endl;
+        return 1;
+    }
+    cout << num_posts << " posts, " << total_words << " unique words" << endl;
+    cout << "istringstream + set<string>: " << stream_ms << " ms, "
+        << double(stream_allocations) / num_posts << " allocations per post" << endl;
+    cout << "split_unique_words: " << split_ms << " ms, "
+        << double(split_allocations) / num_posts << " allocations per post" << endl;
+    if(split_allocations != 0) {
+        cout << "FAIL: split_unique_words allocated after warm-up" << endl;
+        return 1;
+    }
+    return 0;
+}
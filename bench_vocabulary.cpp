@@ -0,0 +1,138 @@
+/* Benchmarks Vocabulary, the classifier's word -> ID index, against
+std::map<string, uint32_t>, which the classifier first used, and
+std::unordered_map<string, uint32_t>, which Vocabulary replaced. For 10^4
+up to MAX_WORDS distinct words, each table interns every word, then looks
+every word up again in a scattered order and checks it finds the right ID;
+the benchmark prints the ns per insert and per lookup of each.
+
+Words are 6 to 15 letters: random letters, then the word's index in six
+letters, so no two are equal. They are made as they are needed rather than
+kept, and the time to make them is in every figure alike.
+
+A size is skipped if its tables would not fit in the machine's memory:
+at 10^8 words each takes several GB.
+
+Usage: bench_vocabulary.exe [MAX_WORDS] */
+
+#include <unistd.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include "vocabulary.h"
+
+using namespace std;
+
+// A rough upper bound on the bytes any of the three tables holds per word
+const size_t BYTES_PER_WORD = 100;
+// Coprime to every power of ten, so i * STRIDE % num_words visits each word
+const uint64_t STRIDE = 2654435761u;
+
+// RETURNS: word number index, of 6 to 15 letters, in buffer
+// MODIFIES: buffer
+string_view make_word(uint64_t index, char *buffer) {
+    uint64_t random = index * 0x9E3779B97F4A7C15ull;
+    random ^= random >> 29;
+    size_t prefix = random % 10;
+    size_t length = 0;
+    for(size_t i = 0; i < prefix; i++) {
+        random = random * 6364136223846793005ull + 1442695040888963407ull;
+        buffer[length++] = char('a' + (random >> 33) % 26);
+    }
+    for(size_t i = 0; i < 6; i++) {
+        buffer[length++] = char('a' + index % 26);
+        index /= 26;
+    }
+    return string_view(buffer, length);
+}
+
+// RETURNS: ns per word of running each(i, word) over num_words words in
+//          order, or in scattered order if scattered, or -1 if any call
+//          returns false
+template<typename Each>
+double time_words(size_t num_words, bool scattered, Each each) {
+    char buffer[16];
+    bool ok = true;
+    auto start = chrono::steady_clock::now();
+    for(uint64_t i = 0; i < num_words; i++) {
+        uint64_t index = scattered ? i * STRIDE % num_words : i;
+        ok = each(uint32_t(index), make_word(index, buffer)) && ok;
+    }
+    double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+    return ok ? ns / num_words : -1;
+}
+
+struct Result {
+    double insert_ns;
+    double find_ns;
+};
+
+// RETURNS: the ns per insert and per lookup of num_words words in Vocabulary
+Result bench_vocabulary(size_t num_words) {
+    Vocabulary vocabulary;
+    Result result;
+    result.insert_ns = time_words(num_words, false, [&](uint32_t index, string_view word) {
+        return vocabulary.intern(word) == index;
+    });
+    result.find_ns = time_words(num_words, true, [&](uint32_t index, string_view word) {
+        return vocabulary.find(word) == index;
+    });
+    return result;
+}
+
+// RETURNS: the ns per insert and per lookup of num_words words in a
+//          std::map or std::unordered_map of strings
+template<typename Map>
+Result bench_map(size_t num_words) {
+    Map map;
+    string key; // reused, so only the table allocates
+    Result result;
+    result.insert_ns = time_words(num_words, false, [&](uint32_t index, string_view word) {
+        key.assign(word);
+        return map.emplace(key, index).second;
+    });
+    result.find_ns = time_words(num_words, true, [&](uint32_t index, string_view word) {
+        key.assign(word);
+        auto found = map.find(key);
+        return found != map.end() && found->second == index;
+    });
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    size_t max_words = argc > 1 ? strtoull(argv[1], nullptr, 10) : 100000000;
+    size_t memory = size_t(sysconf(_SC_PHYS_PAGES)) * size_t(sysconf(_SC_PAGESIZE));
+
+    cout << "ns per insert / find" << endl;
+    cout << "               " << "      vocabulary" << "   unordered_map" << "             map" << endl;
+    bool ok = true;
+    for(size_t num_words = 10000; num_words <= max_words; num_words *= 10) {
+        cout << setw(9) << num_words << " words";
+        if(num_words > memory / BYTES_PER_WORD) {
+            cout << "    skipped, needs about " << num_words * BYTES_PER_WORD / 1000000000
+                << " GB of " << memory / 1000000000 << " GB" << endl;
+            continue;
+        }
+        Result results[] = {
+            bench_vocabulary(num_words),
+            bench_map<unordered_map<string, uint32_t>>(num_words),
+            bench_map<map<string, uint32_t>>(num_words),
+        };
+        for(const Result &result : results) {
+            ok = ok && result.insert_ns >= 0 && result.find_ns >= 0;
+            cout << fixed << setprecision(0) << setw(9) << result.insert_ns << " / "
+                << setw(4) << result.find_ns;
+        }
+        cout << endl;
+    }
+    if(!ok) {
+        cout << "FAIL: a table returned the wrong ID" << endl;
+        return 1;
+    }
+    return 0;
+}
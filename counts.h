@@ -0,0 +1,411 @@
+/* The raw counts collected while training, before they are frozen into a
+Model. Words and labels get IDs in order of first appearance. Tables built
+from separate parts of the training data can be merged, and merging them in
+input order gives exactly the tables of one pass over the whole input.
+Words and labels whose counts drop back to zero can be reclaimed, and their
+IDs are reused, so tables indexed by ID stay as small as the live data.
+
+Counts are whole numbers of posts and are stored as unsigned integers,
+converted to double only where their logs are taken. Most labels occur with
+only a few of the words, so each C_w_count row starts out sparse, holding
+just its nonzero counts, and only becomes a dense array once that takes no
+more memory; memory grows with the nonzero counts, not with labels times
+words. */
+
+#ifndef COUNTS_H
+#define COUNTS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "vocabulary.h"
+
+// A row of counts indexed by word ID, all zero at first. A sparse row is an
+// open-addressing table of its nonzero counts; a dense row is an array
+// reaching the largest index set, 16-bit until a count needs 32. A row is
+// switched to whichever takes less memory when it has to grow, with a margin
+// of 2x so it does not switch back and forth.
+class CountRow {
+    private:
+    struct Entry {
+        uint32_t index; // empty_index if the slot is empty
+        uint32_t count; // never 0 in a used slot
+    };
+    static constexpr uint32_t empty_index = UINT32_MAX;
+
+    std::vector<Entry> entries; // the sparse table, a power of two of slots
+    uint32_t shift = 32; // 32 - log2(entries.size())
+    size_t num_nonzero = 0;
+    uint32_t max_index = 0; // no nonzero count has a larger index
+    bool is_dense = false;
+    std::vector<uint16_t> narrow;
+    std::vector<uint32_t> wide; // holds the counts instead once is_wide
+    bool is_wide = false; // some count has needed 32 bits
+
+    // RETURNS: the first slot probed for index (multiplicative hashing)
+    size_t home_slot(uint32_t index) const {
+        return shift == 32 ? 0 : uint32_t(index * 2654435769u) >> shift;
+    }
+
+    // RETURNS: the slot of index in entries, or the empty slot it belongs in
+    // REQUIRES: entries is not empty
+    size_t find_slot(uint32_t index) const {
+        size_t mask = entries.size() - 1;
+        size_t slot = home_slot(index);
+        while(entries[slot].index != index && entries[slot].index != empty_index) {
+            slot = (slot + 1) & mask;
+        }
+        return slot;
+    }
+
+    // RETURNS: -
+    // EFFECTS: empties the used slot, shifting back later entries of the
+    //          same probe run so no search stops short of them
+    // MODIFIES: entries
+    void erase_slot(size_t slot) {
+        size_t mask = entries.size() - 1;
+        size_t hole = slot;
+        for(size_t next = (hole + 1) & mask; entries[next].index != empty_index; 
+            next = (next + 1) & mask) {
+            // An entry can fill the hole only if the hole is on its probe run
+            size_t home = home_slot(entries[next].index);
+            if(((next - home) & mask) >= ((next - hole) & mask)) {
+                entries[hole] = entries[next];
+                hole = next;
+            }
+        }
+        entries[hole].index = empty_index;
+    }
+
+    // RETURNS: the slots a sparse table needs to hold num_entries counts
+    //          while staying at most 3/4 full, so every search ends
+    static size_t table_size(size_t num_entries) {
+        size_t capacity = 8;
+        while(num_entries * 4 > capacity * 3) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    // RETURNS: the bytes a dense array reaching index would take
+    size_t dense_bytes(size_t index) const {
+        return (index + 1) * (is_wide ? sizeof(uint32_t) : sizeof(uint16_t));
+    }
+
+    // RETURNS: -
+    // REQUIRES: the row is dense and reaches i
+    // EFFECTS: stores count at i
+    // MODIFIES: narrow or wide
+    void store_dense(size_t i, uint32_t count) {
+        if(is_wide) {
+            wide[i] = count;
+        }
+        else {
+            narrow[i] = uint16_t(count);
+        }
+    }
+
+    // RETURNS: -
+    // EFFECTS: rebuilds the row as a sparse table of capacity slots, or as a
+    //          dense array if dense is set, keeping its counts
+    // MODIFIES: the row
+    void rebuild(bool dense, size_t capacity) {
+        std::vector<Entry> counts;
+        counts.reserve(num_nonzero);
+        for_each([&counts](uint32_t i, uint32_t count) {
+            counts.push_back(Entry{i, count});
+        });
+        std::vector<Entry>().swap(entries);
+        std::vector<uint16_t>().swap(narrow);
+        std::vector<uint32_t>().swap(wide);
+        is_dense = dense;
+        if(dense) {
+            is_wide ? wide.assign(size_t(max_index) + 1, 0) 
+                    : narrow.assign(size_t(max_index) + 1, 0);
+            for(const Entry &entry : counts) {
+                store_dense(entry.index, entry.count);
+            }
+            return;
+        }
+        entries.assign(capacity, Entry{empty_index, 0});
+        shift = 32;
+        for(size_t slots = capacity; slots > 1; slots /= 2) {
+            shift--;
+        }
+        for(const Entry &entry : counts) {
+            entries[find_slot(entry.index)] = entry;
+        }
+    }
+
+    public:
+    // RETURNS: the count at i, 0 if it was never set
+    uint32_t operator[](size_t i) const {
+        if(is_dense) {
+            if(is_wide) {
+                return i < wide.size() ? wide[i] : 0;
+            }
+            return i < narrow.size() ? narrow[i] : 0;
+        }
+        if(entries.empty()) {
+            return 0;
+        }
+        const Entry &entry = entries[find_slot(uint32_t(i))];
+        return entry.index == empty_index ? 0 : entry.count;
+    }
+
+    // RETURNS: -
+    // EFFECTS: sets the count at i to count
+    // MODIFIES: the row
+    void set(size_t i, uint32_t count) {
+        uint32_t old_count = (*this)[i];
+        if(count == old_count) {
+            return;
+        }
+        num_nonzero += (count != 0) - (old_count != 0);
+        if(old_count == 0) {
+            max_index = std::max(max_index, uint32_t(i));
+        }
+        if(!is_wide && count > UINT16_MAX) {
+            is_wide = true;
+            if(is_dense) {
+                wide.assign(narrow.begin(), narrow.end());
+                std::vector<uint16_t>().swap(narrow);
+            }
+        }
+
+        if(is_dense) {
+            size_t size = is_wide ? wide.size() : narrow.size();
+            if(i >= size) {
+                // A row only grows out of dense if it is mostly zeros
+                size_t capacity = table_size(num_nonzero);
+                if(dense_bytes(i) > 2 * capacity * sizeof(Entry)) {
+                    num_nonzero--;
+                    rebuild(false, capacity);
+                    num_nonzero++;
+                    entries[find_slot(uint32_t(i))] = Entry{uint32_t(i), count};
+                    return;
+                }
+                is_wide ? wide.resize(i + 1, 0) : narrow.resize(i + 1, 0);
+            }
+            store_dense(i, count);
+            return;
+        }
+
+        if(old_count != 0) {
+            size_t slot = find_slot(uint32_t(i));
+            if(count == 0) {
+                erase_slot(slot);
+            }
+            else {
+                entries[slot].count = count;
+            }
+            return;
+        }
+        if(table_size(num_nonzero) > entries.size()) {
+            size_t capacity = table_size(num_nonzero);
+            num_nonzero--;
+            rebuild(dense_bytes(max_index) <= capacity * sizeof(Entry), capacity);
+            num_nonzero++;
+            if(is_dense) {
+                store_dense(i, count);
+                return;
+            }
+        }
+        entries[find_slot(uint32_t(i))] = Entry{uint32_t(i), count};
+    }
+
+    // RETURNS: -
+    // EFFECTS: adds delta to the count at i, see set
+    // MODIFIES: the row
+    void add(size_t i, int64_t delta) {
+        set(i, uint32_t((*this)[i] + delta));
+    }
+
+    // RETURNS: -
+    // EFFECTS: calls f(i, count) for every nonzero count, in increasing order
+    //          of i if the row is dense and in no particular order if not
+    template <typename F>
+    void for_each(F f) const {
+        if(is_dense) {
+            size_t size = is_wide ? wide.size() : narrow.size();
+            for(size_t i = 0; i < size; i++) {
+                uint32_t count = is_wide ? wide[i] : narrow[i];
+                if(count != 0) {
+                    f(uint32_t(i), count);
+                }
+            }
+            return;
+        }
+        for(const Entry &entry : entries) {
+            if(entry.index != empty_index) {
+                f(entry.index, entry.count);
+            }
+        }
+    }
+
+    // RETURNS: the number of nonzero counts
+    size_t num_counts() const {
+        return num_nonzero;
+    }
+
+    // RETURNS: an estimate of the heap memory held by the row
+    size_t memory_bytes() const {
+        return entries.capacity() * sizeof(Entry) + narrow.capacity() * sizeof(uint16_t) + 
+            wide.capacity() * sizeof(uint32_t);
+    }
+};
+
+struct TrainingCounts {
+    uint64_t total_posts = 0; // Total number of posts counted
+    Vocabulary words; // <word, word ID>
+    Vocabulary labels; // <label, label ID>
+    std::vector<uint32_t> word_count; // For each word ID w, num posts containing w
+    std::vector<uint32_t> label_count; // For each label ID C, num posts labeled C
+    // C_w_count[C][w]: num posts with label C that contain w. Rows must be
+    // changed through add_word, merge and reclaim_label, which keep row_bytes.
+    std::vector<CountRow> C_w_count;
+    size_t row_bytes = 0; // the memory_bytes() of all of C_w_count's rows
+
+    // RETURNS: the ID of label, adding an empty row for it if it is new
+    //          (a reclaimed label's ID comes with its emptied row)
+    // EFFECTS: -
+    // MODIFIES: labels, label_count, C_w_count
+    uint32_t intern_label(std::string_view label_str) {
+        uint32_t label = labels.intern(label_str);
+        if(label == label_count.size()) {
+            label_count.push_back(0);
+            C_w_count.emplace_back();
+        }
+        return label;
+    }
+
+    // RETURNS: the ID of word, adding a zero count for it if it is new
+    // EFFECTS: -
+    // MODIFIES: words, word_count
+    uint32_t intern_word(std::string_view word_str) {
+        uint32_t word = words.intern(word_str);
+        if(word == word_count.size()) {
+            word_count.push_back(0);
+        }
+        return word;
+    }
+
+    // RETURNS: -
+    // EFFECTS: adds count (which may be negative, but must leave both counts
+    //          at least 0) to C_w_count[label][word] and word_count[word]
+    // MODIFIES: C_w_count, word_count
+    void add_word(uint32_t label, uint32_t word, int64_t count) {
+        add_count(C_w_count[label], word, count);
+        word_count[word] += count;
+    }
+
+    // RETURNS: -
+    // EFFECTS: adds count to row[word], keeping row_bytes up to date
+    // MODIFIES: row, row_bytes
+    void add_count(CountRow &row, uint32_t word, int64_t count) {
+        row_bytes -= row.memory_bytes();
+        row.add(word, count);
+        row_bytes += row.memory_bytes();
+    }
+
+    // RETURNS: -
+    // REQUIRES: word_count[word] == 0
+    // EFFECTS: frees the ID of word for the next new word
+    // MODIFIES: words
+    void reclaim_word(uint32_t word) {
+        words.erase(word);
+    }
+
+    // RETURNS: -
+    // REQUIRES: label_count[label] == 0 and C_w_count[label] is all zeros
+    // EFFECTS: frees the ID and the row of label for the next new label
+    // MODIFIES: labels, C_w_count, row_bytes
+    void reclaim_label(uint32_t label) {
+        labels.erase(label);
+        row_bytes -= C_w_count[label].memory_bytes();
+        C_w_count[label] = CountRow();
+    }
+
+    // RETURNS: an estimate of the heap memory held by the tables, in
+    //          constant time, so it can be checked after every post
+    size_t memory_bytes() const {
+        return words.memory_bytes() + labels.memory_bytes() +
+            (word_count.capacity() + label_count.capacity()) * sizeof(uint32_t) +
+            C_w_count.size() * sizeof(CountRow) + row_bytes;
+    }
+
+    // RETURNS: -
+    // EFFECTS: transposes the label rows into per-word postings lists in one
+    //          pass over the rows: the (label ID, C_w_count) pairs of word ID
+    //          w are postings[first[w]] up to postings[first[w + 1]], in the
+    //          order of their labels in label_order
+    // MODIFIES: first, postings
+    void word_postings(const std::vector<uint32_t> &label_order, std::vector<uint32_t> &first,
+                       std::vector<std::pair<uint32_t, uint32_t>> &postings) const {
+        // Count the postings of each word, then place them after the words
+        // before it, so appending label by label keeps label_order
+        first.assign(words.id_limit() + 1, 0);
+        for(uint32_t label : label_order) {
+            C_w_count[label].for_each([&first](uint32_t w, uint32_t) {
+                first[w + 1]++;
+            });
+        }
+        for(size_t w = 0; w < words.id_limit(); w++) {
+            first[w + 1] += first[w];
+        }
+        postings.resize(first.back());
+        std::vector<uint32_t> next(first.begin(), first.end() - 1);
+        for(uint32_t label : label_order) {
+            C_w_count[label].for_each([&](uint32_t w, uint32_t count) {
+                postings[next[w]++] = std::make_pair(label, count);
+            });
+        }
+    }
+
+    // RETURNS: -
+    // EFFECTS: counts one post with the given label and unique words
+    // MODIFIES: all tables
+    void add_post(std::string_view tag, const std::vector<std::string_view> &unique_words) {
+        uint32_t label = intern_label(tag);
+        label_count[label] += 1;
+        for(std::string_view word_str : unique_words) {
+            add_word(label, intern_word(word_str), 1);
+        }
+        total_posts++;
+    }
+
+    // RETURNS: -
+    // EFFECTS: adds the counts of other, which were taken from input that
+    //          comes after this table's, so new words and labels get the IDs
+    //          one pass over both inputs would have given them
+    // MODIFIES: all tables
+    void merge(const TrainingCounts &other) {
+        // Zero counts belong to reclaimed IDs, which have no name to merge
+        std::vector<uint32_t> word_ids(other.words.id_limit());
+        for(uint32_t w = 0; w < word_ids.size(); w++) {
+            if(other.word_count[w] != 0) {
+                word_ids[w] = intern_word(other.words.name(w));
+            }
+        }
+        for(uint32_t other_label = 0; other_label < other.labels.id_limit(); other_label++) {
+            if(other.label_count[other_label] == 0) {
+                continue;
+            }
+            uint32_t label = intern_label(other.labels.name(other_label));
+            label_count[label] += other.label_count[other_label];
+            other.C_w_count[other_label].for_each([&](uint32_t w, uint32_t count) {
+                add_count(C_w_count[label], word_ids[w], count);
+            });
+        }
+        for(uint32_t w = 0; w < word_ids.size(); w++) {
+            if(other.word_count[w] != 0) {
+                word_count[word_ids[w]] += other.word_count[w];
+            }
+        }
+        total_posts += other.total_posts;
+    }
+};
+
+#endif
@@ -0,0 +1,417 @@
+/* A CSV reader that memory-maps its file and hands back fields as
+string_views into the mapping, following the same rules as csvstream: a
+double quote toggles quoting and is dropped, a backslash keeps itself and
+escapes the next character, and a record ends at an unquoted '\n' or '\r',
+which may be followed by one '\n' that belongs to the same record ending.
+Rows must have as many fields as the header, and errors are reported with
+csvstream_exception, so CsvReader can stand in for csvstream.
+
+Files that cannot be mapped (pipes, or "-" for standard input) are streamed
+instead: they are read in blocks as records are needed, and only the
+unfinished record is kept across blocks.
+
+The special characters are found 16 bytes at a time with SSE2 compares
+where available, so the bytes of ordinary text are only looked at once. */
+
+#ifndef CSVREADER_H
+#define CSVREADER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "csvstream.h"
+
+// RETURNS: the first byte in [p, end) that can change the parser state, or
+//          end. Inside quotes only '"' and '\\' matter; outside them the
+//          delimiter and line endings do too.
+inline const char *find_csv_special(const char *p, const char *end, bool quoted,
+                                    char delimiter) {
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i delim = _mm_set1_epi8(delimiter);
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i carriage_return = _mm_set1_epi8('\r');
+    while(end - p >= 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(bytes, quote),
+                                    _mm_cmpeq_epi8(bytes, backslash));
+        if(!quoted) {
+            hits = _mm_or_si128(hits, _mm_or_si128(_mm_cmpeq_epi8(bytes, delim),
+                _mm_or_si128(_mm_cmpeq_epi8(bytes, newline),
+                             _mm_cmpeq_epi8(bytes, carriage_return))));
+        }
+        int mask = _mm_movemask_epi8(hits);
+        if(mask != 0) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    for(; p != end; ++p) {
+        char c = *p;
+        if(c == '"' || c == '\\' ||
+           (!quoted && (c == delimiter || c == '\n' || c == '\r'))) {
+            return p;
+        }
+    }
+    return end;
+}
+
+// RETURNS: the offset just past the end of the record that starts at begin
+//          (data.size() if it runs to the end of data)
+inline size_t find_record_end(std::string_view data, size_t begin, char delimiter = ',') {
+    const char *end = data.data() + data.size();
+    const char *p = data.data() + begin;
+    bool quoted = false;
+    while((p = find_csv_special(p, end, quoted, delimiter)) != end) {
+        char c = *p++;
+        if(c == '\\') {
+            // the escaped character never ends a record
+            if(p != end) {
+                ++p;
+            }
+        }
+        else if(c == '"') {
+            quoted = !quoted;
+        }
+        else if(c == '\n' || c == '\r') {
+            if(p != end && *p == '\n') {
+                ++p;
+            }
+            return p - data.data();
+        }
+    }
+    return data.size();
+}
+
+// RETURNS: up to num_chunks + 1 increasing offsets that split data[begin, end)
+//          into chunks of whole records of roughly equal size; the first is
+//          begin and the last is data.size()
+inline std::vector<size_t> split_records(std::string_view data, size_t begin,
+                                         size_t num_chunks) {
+    std::vector<size_t> bounds{begin};
+    size_t chunk_size = (data.size() - begin) / num_chunks + 1;
+    while(bounds.back() < data.size()) {
+        size_t target = bounds.back() + chunk_size;
+        if(target >= data.size() || bounds.size() == num_chunks) {
+            bounds.push_back(data.size());
+            break;
+        }
+        // Records cannot be found from the middle of the data, since a
+        // newline may be inside quotes, so walk record by record
+        size_t end = bounds.back();
+        while(end < target) {
+            end = find_record_end(data, end);
+        }
+        bounds.push_back(end);
+    }
+    return bounds;
+}
+
+class CsvReader {
+    private:
+    std::string filename;
+    void *mapping = nullptr; // the mmapped file, if this reader owns one
+    size_t mapping_size = 0;
+    bool is_streamed = false; // true if the file cannot be mapped
+    int stream_fd = -1; // the file being streamed, until it runs out
+    std::string buffer; // the unread part of a streamed file
+    std::string_view data; // the records this reader reads
+    size_t pos = 0; // offset of the next record in data
+    size_t line_no = 0;
+    char delimiter;
+    std::vector<std::string> header;
+    size_t num_fields = 0; // fields in the last record read
+    // Column projection, see project(): slot_of[column] is the position of
+    // the column in read_row's output, or npos if it is skipped
+    std::vector<size_t> slot_of;
+    size_t num_slots = 0;
+    // Unquoted copies of fields that contained quotes, reused across rows. A
+    // deque, so growing it does not move the fields already returned.
+    std::deque<std::string> unquoted;
+
+    // RETURNS: -
+    // EFFECTS: maps filename, or sets it up to be streamed into buffer if
+    //          it cannot be mapped (pipes, for example)
+    // MODIFIES: mapping, mapping_size, stream_fd, data
+    void open_file() {
+        int fd = filename == "-" ? dup(STDIN_FILENO) : open(filename.c_str(), O_RDONLY);
+        if(fd < 0) {
+            throw csvstream_exception("Error opening file: " + filename);
+        }
+        struct stat st;
+        if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            if(st.st_size > 0) {
+                void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if(addr != MAP_FAILED) {
+                    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+                    mapping = addr;
+                    mapping_size = st.st_size;
+                    data = std::string_view((const char *)addr, mapping_size);
+                }
+            }
+        }
+        if(mapping) {
+            close(fd);
+        }
+        else {
+            is_streamed = true;
+            stream_fd = fd;
+        }
+    }
+
+    // RETURNS: false if a streamed file has no more data (or is not streamed)
+    // EFFECTS: drops the records before pos from buffer and reads at least
+    //          as much again as is left, so a long record is not rescanned
+    //          once per block
+    // MODIFIES: buffer, data, pos, stream_fd
+    bool fill() {
+        if(stream_fd < 0) {
+            return false;
+        }
+        buffer.erase(0, pos);
+        pos = 0;
+        size_t want = std::max(size_t(65536), buffer.size());
+        size_t old_size = buffer.size();
+        while(buffer.size() - old_size < want) {
+            size_t size = buffer.size();
+            buffer.resize(size + want);
+            ssize_t n = read(stream_fd, &buffer[size], want);
+            buffer.resize(size + std::max(n, ssize_t(0)));
+            if(n <= 0) {
+                close(stream_fd);
+                stream_fd = -1;
+                break;
+            }
+        }
+        data = buffer;
+        return buffer.size() > old_size;
+    }
+
+    // RETURNS: the field [begin, end) with its quotes removed, stored in
+    //          unquoted[field] if it had any
+    // MODIFIES: unquoted
+    std::string_view make_field(const char *begin, const char *end, bool had_quotes,
+                                size_t field) {
+        if(!had_quotes) {
+            return std::string_view(begin, end - begin);
+        }
+        if(unquoted.size() <= field) {
+            unquoted.resize(field + 1);
+        }
+        std::string &out = unquoted[field];
+        out.clear();
+        for(const char *p = begin; p != end; ++p) {
+            if(*p == '\\') {
+                out += *p;
+                if(++p == end) {
+                    break;
+                }
+                out += *p;
+            }
+            else if(*p != '"') {
+                out += *p;
+            }
+        }
+        return out;
+    }
+
+    // RETURNS: false if there are no records left
+    // EFFECTS: splits the next record into fields, which stay valid until
+    //          the next call. With a projection, only the projected columns
+    //          are stored, in projection order; the rest are only counted.
+    //          A streamed record that runs past the data read so far is
+    //          started over once more has been read.
+    // MODIFIES: fields, num_fields, pos, unquoted, buffer
+    bool next_record(std::vector<std::string_view> &fields) {
+        bool complete = false;
+        while(!complete) {
+            if(pos >= data.size() && !fill()) {
+                num_fields = 0;
+                fields.clear();
+                return false;
+            }
+            complete = scan_record(fields);
+        }
+        return true;
+    }
+
+    // RETURNS: false if the record at pos may continue past the end of data
+    //          in a streamed file that has more to read, after reading more
+    // EFFECTS: splits the record at pos into fields, see next_record, and
+    //          moves pos past it if it is complete
+    // MODIFIES: fields, num_fields, pos, unquoted, buffer
+    bool scan_record(std::vector<std::string_view> &fields) {
+        num_fields = 0;
+        if(slot_of.empty()) {
+            fields.clear();
+        }
+        else {
+            fields.assign(num_slots, std::string_view());
+        }
+        const char *end = data.data() + data.size();
+        const char *p = data.data() + pos;
+        const char *field_begin = p;
+        bool quoted = false;
+        bool had_quotes = false;
+        auto end_field = [&](const char *field_end) {
+            if(slot_of.empty()) {
+                fields.push_back(make_field(field_begin, field_end, had_quotes, num_fields));
+            }
+            else if(num_fields < slot_of.size() && slot_of[num_fields] != npos) {
+                size_t slot = slot_of[num_fields];
+                fields[slot] = make_field(field_begin, field_end, had_quotes, slot);
+            }
+            num_fields++;
+        };
+        while(true) {
+            p = find_csv_special(p, end, quoted, delimiter);
+            if(p == end) {
+                if(stream_fd >= 0) {
+                    fill();
+                    return false;
+                }
+                end_field(end);
+                break;
+            }
+            char c = *p;
+            if(c == '\\') {
+                p = p + 1 == end ? end : p + 2;
+            }
+            else if(c == '"') {
+                quoted = !quoted;
+                had_quotes = true;
+                ++p;
+            }
+            else if(c == delimiter) {
+                end_field(p);
+                field_begin = ++p;
+                had_quotes = false;
+            }
+            else {
+                // The '\n' that may follow may not have been read yet
+                if(p + 1 == end && stream_fd >= 0) {
+                    fill();
+                    return false;
+                }
+                end_field(p);
+                ++p;
+                if(p != end && *p == '\n') {
+                    ++p;
+                }
+                break;
+            }
+        }
+        pos = p - data.data();
+        return true;
+    }
+
+    public:
+    // EFFECTS: opens filename and reads its header
+    explicit CsvReader(const std::string &filename_in, char delimiter_in = ',')
+        : filename(filename_in), delimiter(delimiter_in) {
+        open_file();
+        std::vector<std::string_view> fields;
+        next_record(fields);
+        header.assign(fields.begin(), fields.end());
+        // An empty file has one empty column, as in csvstream
+        if(header.empty()) {
+            header.emplace_back();
+        }
+    }
+
+    // EFFECTS: reads the records in [begin, end) of parent's data, with
+    //          parent's header and projection. parent must outlive this reader.
+    CsvReader(const CsvReader &parent, size_t begin, size_t end)
+        : filename(parent.filename), data(parent.data.substr(0, end)), pos(begin),
+          delimiter(parent.delimiter), header(parent.header), 
+          slot_of(parent.slot_of), num_slots(parent.num_slots) {}
+
+    CsvReader(const CsvReader &) = delete;
+    CsvReader &operator=(const CsvReader &) = delete;
+
+    ~CsvReader() {
+        if(mapping) {
+            munmap(mapping, mapping_size);
+        }
+        if(stream_fd >= 0) {
+            close(stream_fd);
+        }
+    }
+
+    const std::vector<std::string> &getheader() const {
+        return header;
+    }
+
+    // RETURNS: true if the file is streamed rather than mapped, in which case
+    //          it cannot be split into chunks with contents()
+    bool streamed() const {
+        return is_streamed;
+    }
+
+    // RETURNS: the whole file, for splitting with split_records
+    // REQUIRES: !streamed()
+    std::string_view contents() const {
+        return data;
+    }
+
+    // RETURNS: the offset in contents() of the first record after the header
+    size_t records_begin() const {
+        return pos;
+    }
+
+    static constexpr size_t npos = size_t(-1);
+
+    // RETURNS: -
+    // EFFECTS: makes read_row return only the named columns, in this order.
+    //          The header is searched once here, and the other columns are
+    //          skipped without being copied or unquoted. A name that is not
+    //          in the header reads as an empty field, as a missing key of
+    //          csvstream's row map would.
+    // MODIFIES: slot_of, num_slots
+    void project(const std::vector<std::string> &columns) {
+        slot_of.assign(header.size(), npos);
+        num_slots = columns.size();
+        for(size_t slot = 0; slot < columns.size(); slot++) {
+            for(size_t i = 0; i < header.size(); i++) {
+                if(header[i] == columns[slot] && slot_of[i] == npos) {
+                    slot_of[i] = slot;
+                    break;
+                }
+            }
+        }
+    }
+
+    // RETURNS: false if there are no records left
+    // EFFECTS: reads the next row into fields (only the projected columns, if
+    //          project() was called), as views that stay valid until the
+    //          next call. Throws csvstream_exception if the row does not
+    //          have as many fields as the header.
+    // MODIFIES: fields
+    bool read_row(std::vector<std::string_view> &fields) {
+        if(!next_record(fields)) {
+            return false;
+        }
+        line_no += 1;
+        if(num_fields != header.size()) {
+            throw csvstream_exception("Number of items in row does not match header. " +
+                filename + ":L" + std::to_string(line_no) + " " +
+                "header.size() = " + std::to_string(header.size()) + " " +
+                "row.size() = " + std::to_string(num_fields) + " ");
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,166 @@
+/* Checks Classifier::forget: observing every post and then forgetting some
+must give the same model, byte for byte as saved by --save-model, as only
+ever observing the rest. It checks this for plain online training, for
+posts forgotten from inside a --window, and for a model trained and
+finalized before anything is forgotten. The forgotten posts include words
+and a label no other post has, so their reclaiming is covered too.
+
+main.cpp is included with main renamed, so the test can drive its
+Classifier directly. Build and run with make test. */
+
+#define main classifier_main
+#include "main.cpp"
+#undef main
+
+#include <deque>
+#include "run_classifier.h"
+
+struct Post {
+    string tag;
+    string content;
+};
+
+const size_t NUM_POSTS = 40;
+
+// RETURNS: NUM_POSTS distinct posts over 4 labels and 30 shared words; the
+//          posts forgotten() picks also get words of their own, and the
+//          last of them a label of its own
+vector<Post> make_posts() {
+    vector<Post> posts(NUM_POSTS);
+    for(size_t i = 0; i < NUM_POSTS; i++) {
+        posts[i].tag = "tag" + to_string(i % 4);
+        posts[i].content = "post" + to_string(i);
+        for(size_t k = 0; k < 2 + i % 7; k++) {
+            posts[i].content += " word" + to_string((i * 7 + k * 11) % 30);
+        }
+    }
+    for(size_t i = 3; i < NUM_POSTS; i += 5) {
+        posts[i].content += " only" + to_string(i);
+    }
+    posts[NUM_POSTS - 2].tag = "lonely";
+    return posts;
+}
+
+// RETURNS: true if the post with index i is one the test forgets
+bool forgotten(size_t i) {
+    return i % 5 == 3;
+}
+
+// RETURNS: the model classifier saves with --save-model
+string saved_model(const Classifier &classifier) {
+    string model_file = temp_dir() + "/forget_test.model";
+    classifier.save_model(model_file);
+    string model = read_file(model_file);
+    remove(model_file.c_str());
+    return model;
+}
+
+// RETURNS: true if a and b save the same model
+// EFFECTS: prints whether they do
+bool check_same(const string &name, const Classifier &a, const Classifier &b) {
+    bool same = saved_model(a) == saved_model(b);
+    cout << name << (same ? ": same model" : ": -- FAILED, the models differ") << endl;
+    return same;
+}
+
+int main() {
+    vector<Post> posts = make_posts();
+    bool ok = true;
+
+    // Observe all, then forget some
+    {
+        Classifier all;
+        Classifier rest;
+        for(size_t i = 0; i < NUM_POSTS; i++) {
+            all.observe(posts[i].tag, posts[i].content);
+            if(!forgotten(i)) {
+                rest.observe(posts[i].tag, posts[i].content);
+            }
+        }
+        for(size_t i = 0; i < NUM_POSTS; i++) {
+            if(forgotten(i) && !all.forget(posts[i].tag, posts[i].content)) {
+                cout << "online: -- FAILED, could not forget post " << i << endl;
+                ok = false;
+            }
+        }
+        ok = check_same("online", all, rest) && ok;
+        if(all.forget(posts[3].tag, posts[3].content)) {
+            cout << "online: -- FAILED, forgot a post twice" << endl;
+            ok = false;
+        }
+    }
+
+    // Forget posts still in the window and keep observing: the window must
+    // then hold the posts a window of that size would, less the forgotten
+    // ones, which later retirements skip
+    {
+        const size_t window = 12;
+        Classifier all;
+        all.set_window(window);
+        deque<size_t> held; // the posts all's window should hold
+        for(size_t i = 0; i < NUM_POSTS; i++) {
+            if(held.size() == window) {
+                held.pop_front();
+            }
+            held.push_back(i);
+            all.observe(posts[i].tag, posts[i].content);
+            // Forget each such post a few posts after it arrives
+            if(i >= 2 && forgotten(i - 2)) {
+                if(!all.forget(posts[i - 2].tag, posts[i - 2].content)) {
+                    cout << "--window: -- FAILED, could not forget post " << i - 2 << endl;
+                    ok = false;
+                }
+                held.erase(find(held.begin(), held.end(), i - 2));
+            }
+        }
+        Classifier rest;
+        for(size_t i : held) {
+            rest.observe(posts[i].tag, posts[i].content);
+        }
+        ok = check_same("--window", all, rest) && ok;
+        // A post the window already retired is no longer in the model
+        if(all.forget(posts[0].tag, posts[0].content)) {
+            cout << "--window: -- FAILED, forgot a retired post" << endl;
+            ok = false;
+        }
+    }
+
+    // Train and finalize, then forget some
+    {
+        string all_file = temp_dir() + "/forget_test_all.csv";
+        string rest_file = temp_dir() + "/forget_test_rest.csv";
+        write_posts(all_file, NUM_POSTS, [&](ostream &out, size_t row) {
+            out << posts[row].tag << "," << posts[row].content;
+        });
+        vector<Post> kept;
+        for(size_t i = 0; i < NUM_POSTS; i++) {
+            if(!forgotten(i)) {
+                kept.push_back(posts[i]);
+            }
+        }
+        write_posts(rest_file, kept.size(), [&](ostream &out, size_t row) {
+            out << kept[row].tag << "," << kept[row].content;
+        });
+
+        Classifier all;
+        Classifier rest;
+        CsvReader all_in(all_file);
+        CsvReader rest_in(rest_file);
+        all.train_classifier(all_in);
+        all.finalize();
+        rest.train_classifier(rest_in);
+        rest.finalize();
+        for(size_t i = 0; i < NUM_POSTS; i++) {
+            if(forgotten(i) && !all.forget(posts[i].tag, posts[i].content)) {
+                cout << "finalized: -- FAILED, could not forget post " << i << endl;
+                ok = false;
+            }
+        }
+        ok = check_same("finalized", all, rest) && ok;
+        remove(all_file.c_str());
+        remove(rest_file.c_str());
+    }
+
+    cout << (ok ? "PASS" : "FAIL") << endl;
+    return ok ? 0 : 1;
+}
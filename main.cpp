@@ -5,45 +5,113 @@ This approach is called (supervised) machine learning. Once we’ve trained the
 classifier on some set of Piazza posts, we can apply it to new ones written in 
 the future. */
 
-#include <map>
-#include <set>
 #include <string>
+#include <string_view>
 #include <iostream>
 #include <vector>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <exception>
+#include <functional>
+#include <fstream>
 #include <math.h>
+#include <optional>
+#include <thread>
+#include <sys/resource.h>
+#include "counts.h"
+#include "csvreader.h"
 #include "csvstream.h"
+#include "model.h"
+#include "online.h"
+#include "parallel.h"
+#include "prune.h"
+#include "sketch.h"
+#include "spill.h"
+#include "tokenizer.h"
+#include "vocabulary.h"
 
 using namespace std;
 
+// RETURNS: milliseconds elapsed since start
+double elapsed_ms(chrono::steady_clock::time_point start) {
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+// RETURNS: the most memory the process has had resident so far, in MB
+double peak_rss_mb() {
+    rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0); // bytes on macOS
+#else
+    return usage.ru_maxrss / 1024.0; // KB on Linux
+#endif
+}
+
+// Per-thread buffers for scoring a post, reused from post to post
+struct PostScratch {
+    vector<string_view> words; // unique words of the post
+    vector<uint32_t> word_ids; // IDs of words, see resolve_words
+    vector<double> label_scores; // for Model::sparse_scores, by label ID
+    vector<uint32_t> buckets; // for SketchModel::scores
+};
+
 class Classifier {
     private:
-    double total_posts; // Total number of posts in the entire training set
+    uint64_t total_posts; // Total number of posts in the entire training set
     double vocab_size;  // Number of unique words in the entire training set
-    map<string,double> word_count; // For each word w, the num posts in set containing w
-    map<string,double> label_count; // For each label C, num posts in set labeled C
-    map<string, map<string,double>> C_w_count; // Num posts with label C that contain w
-    map<string, string> post; // <column name, cell datum>
-    map<string,string> correct_post; // for checking correctness: <post, correct label>
-                                
+    // Training tables, only filled between train_classifier and finalize
+    TrainingCounts counts;
+    // Set instead of counts by train_classifier_external
+    optional<SpillingCounts> spilling;
+    // Set instead of counts by train_classifier_pruned
+    optional<PruningCounts> pruning;
+    PruneStats prune_stats; // how much finalize() pruned, for --min-df
+    Model model; // Read-only parameters used for scoring, built by finalize
+    // Parameters that keep learning, used instead of model once observe()
+    // has been called
+    OnlineModel online;
+    bool learning = false;
+    // The posts observe() keeps with set_window, by the IDs of their label
+    // and words, which stay valid while the posts are counted. window is a
+    // ring of window_count posts from window_start, oldest first; a retired
+    // post's slot and buffer take the next post, so a full window allocates
+    // nothing.
+    struct WindowPost {
+        uint32_t label;
+        vector<uint32_t> word_ids;
+    };
+    vector<WindowPost> window;
+    size_t window_start = 0;
+    size_t window_count = 0;
+    size_t window_size = 0; // 0 keeps every post
+    // Approximate parameters of fixed size, used instead of model after
+    // train_classifier_sketch
+    SketchModel sketch;
+    bool sketching = false;
+    // The columns read from training and test files, and their positions
+    // in a row read after csvin.project(POST_COLUMNS)
+    const vector<string> POST_COLUMNS = {"tag", "content"};
+    enum { TAG, CONTENT };
+    vector<string_view> row; // the current row of a training file
+    PostScratch scratch; // for unique_words
 
     public:
 
-    // RETURNS: a set containing the unique "words" in the original
-    //          string, delimited by whitespace
+    // RETURNS: the unique "words" in the original string, delimited by
+    //          whitespace, in sorted order. The views point into str and
+    //          are overwritten by the next call.
     // EFFECTS: -
-    // MODIFIES: -
-    set<string> unique_words(const string &str) {
-        istringstream source(str);
-        set<string> words;
-        string word;
-
-        // Read word by word from the stringstream and insert into the set
-        while (source >> word) {
-            words.insert(word);
-        }
-        return words;
+    // MODIFIES: scratch
+    const vector<string_view> &unique_words(string_view str) {
+        split_unique_words(str, scratch.words);
+        return scratch.words;
     }
 
     int get_total_posts() {
@@ -56,27 +124,42 @@ class Classifier {
 
     // RETURNS: double representing log prior 
         // = log(num training posts with label C / num training posts)
+    // REQUIRES: finalize() was called
     // EFFECTS: -
     // MODIFIES: -
-    double calc_log_prior(string label) {
-        return log(label_count[label]/total_posts);
+    double calc_log_prior(uint32_t label) const {
+        if(sketching) {
+            return sketch.log_prior(label);
+        }
+        return learning ? online.log_prior(label) : model.log_prior(label);
     }
 
-    // RETURNS: double representing log likelihood 
+    // RETURNS: double representing log likelihood, looked up in the tables
+        // the model precomputed at finalize()
+    // REQUIRES: finalize() was called
     // EFFECTS: -
     // MODIFIES: -
-    double calc_log_likelihood(string label, string word) {
-        // If w does not occur in posts labeled C but occurs in training set
-        if(C_w_count[label][word] == 0 && word_count[word] != 0) {
-            return log(word_count[word] / total_posts);
-        }
-        // If w does not occur anywhere in training set
-        else if (word_count[word] == 0) {
-            return log(1 / total_posts);
+    double calc_log_likelihood(uint32_t label, uint32_t word) const {
+        return learning ? online.log_likelihood(label, word) 
+            : model.log_likelihood(label, word);
+    }
+
+    string_view label_name(uint32_t label) const {
+        if(sketching) {
+            return sketch.label_name(label);
         }
-        // log(num posts with label C containing w / num training posts)
-        else {
-            return log(C_w_count[label][word]/label_count[label]);
+        return learning ? online.label_name(label) : model.label_name(label);
+    }
+
+    // RETURNS: -
+    // EFFECTS: tokenizes str once and looks up each unique word's ID, in the
+    //          sorted word order; unseen words map to Vocabulary::npos
+    // MODIFIES: post.words, post.word_ids
+    void resolve_words(const string &str, PostScratch &post) const {
+        split_unique_words(str, post.words);
+        post.word_ids.clear();
+        for(string_view word : post.words) {
+            post.word_ids.push_back(learning ? online.find_word(word) : model.find_word(word));
         }
     }
 
@@ -84,56 +167,90 @@ class Classifier {
     //sum of log-prior and log likelihoods of each unique word in post
     // RETURNS: double representing log probability score
         // calculated from summing log likelihood of each word in the post
-    // EFFECTS: calls calc_log_prior(string label)
+    // REQUIRES: word_ids came from resolve_words()
+    // EFFECTS: calls calc_log_prior(uint32_t label)
     // MODIFIES: -
-    double calc_log_prob_score(string label) {
-        string content = correct_post["content"];
-        set<string> unique_post_words = unique_words(content);
+    double calc_log_prob_score(uint32_t label, const vector<uint32_t> &word_ids) const {
         double log_prior = calc_log_prior(label);
         double log_prob_score = log_prior;
         
-        for(auto word : unique_post_words) {
+        for(uint32_t word : word_ids) {
             log_prob_score += calc_log_likelihood(label, word);
         }
         return log_prob_score;
     }
 
-    // RETURNS: -
-    // EFFECTS: prints training data
-    // MODIFIES: -
-    void print_label_content(int argc, char* argv[]) {
-        const string debug = argv[3];
-        string train_file = argv[1];
-        csvstream csvin(train_file);
-        cout << "training data:" << endl;
-        // For each post, print "label = ___, content = ____"
-        while(csvin >> post) {  
-            cout << "  label = " << post["tag"] << ", content = " 
-            << post["content"] << endl;
-        }
-    }
-
     // RETURNS: -
     // EFFECTS: prints the classes in the training data and num examples for each;
         // prints for each label, and for each word that occurs for that label: 
         // the number of posts with that label that contained the word, 
         // and the log-likelihood of the word given the label.
     // MODIFIES: 
-    void print_debug_data(int argc, char* argv[]) {
-        const string debug = argv[3];
-        
+    void print_debug_data() {
+        if(sketching) {
+            print_classes(sketch);
+            // The sketches keep no words to list parameters for
+            cout << "classifier parameters:" << endl;
+            cout << "  (not stored by a sketch model)" << endl;
+            cout << "\n";
+        }
+        else if(learning) {
+            print_parameters(online);
+        }
+        else {
+            print_parameters(model);
+        }
+    }
+
+    // RETURNS: -
+    // EFFECTS: prints each label of params with its num examples and
+        // log-prior, in sorted order
+    // MODIFIES: -
+    template <typename Params>
+    void print_classes(const Params &params) const {
         cout << "classes:" << endl;
-        for(auto label : label_count) {
-            cout << "  " << label.first << ", " << label.second << " examples, " 
-                << "log-prior = " << calc_log_prior(label.first) << endl;
+        for(uint32_t rank = 0; rank < params.num_labels(); rank++) {
+            uint32_t label = params.label_by_rank(rank);
+            cout << "  " << params.label_name(label) << ", " 
+                << params.get_label_count(label) << " examples, " 
+                << "log-prior = " << calc_log_prior(label) << endl;
         }
+    }
+
+    // RETURNS: -
+    // EFFECTS: prints the debug data of params (model or online), labels and
+        // words in sorted order. The postings of each word are read once and
+        // grouped by label, so only nonzero counts are visited.
+    // MODIFIES: -
+    template <typename Params>
+    void print_parameters(const Params &params) const {
+        print_classes(params);
         
         cout << "classifier parameters:" << endl;
-        for(const auto& label : C_w_count) {
-            for(const auto& word_pair : label.second) {
-                cout << "  " << label.first << ":" << word_pair.first << 
-                    ", count = " << word_pair.second << ", log-likelihood = "
-                    << calc_log_likelihood(label.first, word_pair.first) << endl;
+        // label_words[C]: the (word ID, C_w_count) pairs of label C, in
+        // sorted word order
+        vector<vector<pair<uint32_t, uint32_t>>> label_words;
+        vector<pair<uint32_t, uint32_t>> postings;
+        for(uint32_t word : params.sorted_word_ids()) {
+            params.get_postings(word, postings);
+            for(const pair<uint32_t, uint32_t> &posting : postings) {
+                if(posting.first >= label_words.size()) {
+                    label_words.resize(posting.first + 1);
+                }
+                label_words[posting.first].emplace_back(word, posting.second);
+            }
+        }
+        for(uint32_t rank = 0; rank < params.num_labels(); rank++) {
+            uint32_t label = params.label_by_rank(rank);
+            if(label >= label_words.size()) {
+                continue;
+            }
+            for(const pair<uint32_t, uint32_t> &word_count : label_words[label]) {
+                uint32_t word = word_count.first;
+                double count = word_count.second;
+                cout << "  " << params.label_name(label) << ":" << params.word_name(word) << 
+                    ", count = " << count << ", log-likelihood = "
+                    << calc_log_likelihood(label, word) << endl;
             }
         }
         // extra blankline
@@ -142,44 +259,572 @@ class Classifier {
     }
 
     // RETURNS: -
-    // EFFECTS: calls unique_words(const string &str)
-    // MODIFIES: label_count, word_count, C_w_count, total_posts, vocab_size
-    void train_classifier(int argc, char *argv[]) {
-        string train_file = argv[1];
-        csvstream csvin(train_file);
-
-        set<string> unique_words_set;
-
-        total_posts = 0;
-        while(csvin >> post) {
-            label_count[post["tag"]] += 1;
-            unique_words_set = unique_words(post["content"]);
-            for(auto word : unique_words_set) {
-                word_count[word] += 1;
-                C_w_count[post["tag"]][word] += 1;
+    // EFFECTS: prints the line the debug output starts the training data with
+    // MODIFIES: -
+    static void echo_header() {
+        cout << "training data:" << endl;
+    }
+
+    // RETURNS: -
+    // EFFECTS: appends the line the debug output echoes a training post as,
+        // "  label = ___, content = ____"
+    // MODIFIES: out
+    static void append_echo(string &out, string_view tag, string_view content) {
+        out.append("  label = ").append(tag).append(", content = ").append(content)
+            .append("\n");
+    }
+
+    // RETURNS: false if add_post returned false, which stops reading
+    // EFFECTS: calls add_post(tag, content) for every post of csvin, in
+        // order. If echo is set, also prints the training data as it is read,
+        // so the debug output needs no second pass over the file.
+    // MODIFIES: csvin, row
+    template <typename AddPost>
+    bool train_posts(CsvReader &csvin, bool echo, AddPost add_post) {
+        csvin.project(POST_COLUMNS);
+
+        if(echo) {
+            echo_header();
+        }
+        string line; // reused, so echoing allocates nothing per post
+        while(csvin.read_row(row)) {
+            if(echo) {
+                line.clear();
+                append_echo(line, row[TAG], row[CONTENT]);
+                cout << line << flush;
+            }
+            if(!add_post(row[TAG], row[CONTENT])) {
+                return false;
             }
-            
-            total_posts++;
         }
+        return true;
+    }
+
+    // RETURNS: -
+    // EFFECTS: counts every post of csvin, calling unique_words(string_view str).
+        // If echo is set, also prints the training data as it is read.
+    // MODIFIES: csvin, counts, total_posts, vocab_size
+    void train_classifier(CsvReader &csvin, bool echo = false) {
+        train_posts(csvin, echo, [this](string_view tag, string_view content) {
+            counts.add_post(tag, unique_words(content));
+            return true;
+        });
         
-        vocab_size = word_count.size();
+        total_posts = counts.total_posts;
+        vocab_size = counts.words.size();
+    }
+
+    // RETURNS: -
+    // EFFECTS: trains like train_classifier, but splits the training file into
+        // num_threads chunks of whole records, counts each chunk in its own
+        // table on its own thread, then merges the tables pairwise in a tree.
+        // Merging in input order gives the same tables as one serial pass.
+        // If echo is set, each chunk also formats its part of the training
+        // data echo, and the parts are printed in input order.
+    // MODIFIES: csvin, counts, total_posts, vocab_size
+    void train_classifier_parallel(CsvReader &csvin, size_t num_threads, 
+                                   bool echo = false) {
+        csvin.project(POST_COLUMNS);
+        vector<size_t> bounds = 
+            split_records(csvin.contents(), csvin.records_begin(), num_threads);
+        size_t num_chunks = bounds.size() - 1;
+
+        vector<TrainingCounts> chunk_counts(max(num_chunks, size_t(1)));
+        vector<exception_ptr> errors(num_chunks);
+        vector<string> echoes(num_chunks);
+        vector<thread> workers;
+        for(size_t i = 0; i < num_chunks; i++) {
+            workers.emplace_back([&, i]() {
+                try {
+                    CsvReader chunk(csvin, bounds[i], bounds[i + 1]);
+                    vector<string_view> chunk_row;
+                    vector<string_view> row_words;
+                    while(chunk.read_row(chunk_row)) {
+                        if(echo) {
+                            append_echo(echoes[i], chunk_row[TAG], chunk_row[CONTENT]);
+                        }
+                        split_unique_words(chunk_row[CONTENT], row_words);
+                        chunk_counts[i].add_post(chunk_row[TAG], row_words);
+                    }
+                }
+                catch(...) {
+                    errors[i] = current_exception();
+                }
+            });
+        }
+        for(thread &worker : workers) {
+            worker.join();
+        }
+        // The echo stops where a serial pass would have stopped on an error
+        if(echo) {
+            echo_header();
+        }
+        for(size_t i = 0; i < num_chunks; i++) {
+            cout << echoes[i] << flush;
+            if(errors[i]) {
+                rethrow_exception(errors[i]);
+            }
+        }
+
+        // Tree reduction: each round merges chunk i + step into chunk i
+        for(size_t step = 1; step < num_chunks; step *= 2) {
+            workers.clear();
+            for(size_t i = 0; i + step < num_chunks; i += 2 * step) {
+                workers.emplace_back([&chunk_counts, i, step]() {
+                    chunk_counts[i].merge(chunk_counts[i + step]);
+                    chunk_counts[i + step] = TrainingCounts();
+                });
+            }
+            for(thread &worker : workers) {
+                worker.join();
+            }
+        }
+
+        counts = move(chunk_counts[0]);
+        total_posts = counts.total_posts;
+        vocab_size = counts.words.size();
+    }
+
+    // RETURNS: -
+    // EFFECTS: trains like train_classifier, but overlaps the three stages:
+        // this thread parses batches of posts, num_threads tokenizer threads
+        // split each post into its unique words, and one counter thread
+        // counts the batches (and echoes them, if echo is set) in input order.
+        // The stages pass batches through bounded queues, and a fixed set of
+        // batches is recycled, so a slow stage holds the others back instead
+        // of letting memory grow. Unlike train_classifier_parallel, this
+        // needs no byte offsets, so it also works on pipes and stdin.
+    // MODIFIES: csvin, counts, total_posts, vocab_size
+    void train_classifier_pipelined(CsvReader &csvin, size_t num_threads, 
+                                    bool echo = false) {
+        csvin.project(POST_COLUMNS);
+
+        struct PostBatch {
+            size_t seq = 0; // position of the batch in the input
+            size_t size = 0;
+            // Buffers are reused when the batch is recycled, so they only
+            // grow to the size of the largest batch and post
+            vector<string> tags;
+            vector<string> contents;
+            vector<vector<string_view>> words; // unique words of each post
+        };
+        const size_t batch_size = 256;
+        const size_t num_batches = 4 * (num_threads + 2);
+        vector<PostBatch> batches(num_batches);
+        BoundedQueue<PostBatch *> free_batches(num_batches);
+        BoundedQueue<PostBatch *> parsed(num_batches);
+        BoundedQueue<PostBatch *> tokenized(num_batches);
+        for(PostBatch &batch : batches) {
+            free_batches.push(&batch);
+        }
+
+        // errors[0] is the reader's, then each tokenizer's, then the counter's.
+        // A read error lets the batches before it finish, like a serial pass;
+        // any other error stops every stage.
+        vector<exception_ptr> errors(num_threads + 2);
+        auto abort_stages = [&](size_t stage) {
+            errors[stage] = current_exception();
+            free_batches.close();
+            parsed.close();
+            tokenized.close();
+        };
+
+        vector<thread> workers;
+        atomic<size_t> num_tokenizers(num_threads);
+        for(size_t t = 0; t < num_threads; t++) {
+            workers.emplace_back([&, t]() {
+                try {
+                    PostBatch *batch;
+                    while(parsed.pop(batch)) {
+                        if(batch->words.size() < batch->size) {
+                            batch->words.resize(batch->size);
+                        }
+                        for(size_t i = 0; i < batch->size; i++) {
+                            split_unique_words(batch->contents[i], batch->words[i]);
+                        }
+                        if(!tokenized.push(batch)) {
+                            break;
+                        }
+                    }
+                }
+                catch(...) {
+                    abort_stages(t + 1);
+                }
+                if(--num_tokenizers == 0) {
+                    tokenized.close();
+                }
+            });
+        }
+
+        workers.emplace_back([&]() {
+            try {
+                // Batches finish tokenizing out of order. Each waits in
+                // pending[seq % num_batches] until the ones before it are
+                // counted; no more than num_batches are ever in flight.
+                vector<PostBatch *> pending(num_batches, nullptr);
+                size_t next_seq = 0;
+                string line; // for echo
+                PostBatch *batch;
+                while(tokenized.pop(batch)) {
+                    pending[batch->seq % num_batches] = batch;
+                    while((batch = pending[next_seq % num_batches]) != nullptr) {
+                        pending[next_seq % num_batches] = nullptr;
+                        for(size_t i = 0; i < batch->size; i++) {
+                            if(echo) {
+                                line.clear();
+                                append_echo(line, batch->tags[i], batch->contents[i]);
+                                cout << line << flush;
+                            }
+                            counts.add_post(batch->tags[i], batch->words[i]);
+                        }
+                        next_seq++;
+                        free_batches.push(batch);
+                    }
+                }
+            }
+            catch(...) {
+                abort_stages(num_threads + 1);
+            }
+        });
+
+        if(echo) {
+            echo_header();
+        }
+        size_t seq = 0;
+        bool more = true;
+        PostBatch *batch;
+        while(more && free_batches.pop(batch)) {
+            batch->seq = seq;
+            batch->size = 0;
+            try {
+                while(batch->size < batch_size && (more = csvin.read_row(row))) {
+                    if(batch->size == batch->tags.size()) {
+                        batch->tags.emplace_back();
+                        batch->contents.emplace_back();
+                    }
+                    batch->tags[batch->size].assign(row[TAG]);
+                    batch->contents[batch->size].assign(row[CONTENT]);
+                    batch->size++;
+                }
+            }
+            catch(...) {
+                errors[0] = current_exception();
+                more = false;
+            }
+            if(batch->size > 0) {
+                seq++;
+                if(!parsed.push(batch)) {
+                    break;
+                }
+            }
+        }
+        parsed.close();
+
+        for(thread &worker : workers) {
+            worker.join();
+        }
+        for(exception_ptr &error : errors) {
+            if(error) {
+                rethrow_exception(error);
+            }
+        }
+
+        total_posts = counts.total_posts;
+        vocab_size = counts.words.size();
+    }
+
+    // RETURNS: -
+    // EFFECTS: moves the counts (trained, or thawed from the finalized or
+        // loaded model) into the online parameters, the first time
+    // MODIFIES: online, learning, counts, model
+    void start_learning() {
+        if(!learning) {
+            online = OnlineModel(model.get_total_posts() > 0 ? model.to_counts() 
+                                                             : move(counts));
+            model = Model();
+            counts = TrainingCounts();
+            learning = true;
+        }
+    }
+
+    // RETURNS: -
+    // EFFECTS: learns from one more post. Each post only refreshes the log
+        // tables of its label and words, and predictions see it at once.
+        // With a window, the oldest post is forgotten once there are more
+        // than window_size.
+    // MODIFIES: online, learning, counts, model, window, total_posts, vocab_size
+    void observe(string_view tag, string_view content) {
+        start_learning();
+        uint32_t label = online.add_post(tag, unique_words(content), scratch.word_ids);
+        if(window_size > 0) {
+            if(window_count == window_size) {
+                const WindowPost &oldest = window[window_start];
+                online.remove_post(oldest.label, oldest.word_ids);
+                window_start = (window_start + 1) % window.size();
+                window_count--;
+            }
+            // The ring only grows before it first fills, while window_start is 0
+            if(window_count == window.size()) {
+                window.emplace_back();
+            }
+            WindowPost &post = window[(window_start + window_count) % window.size()];
+            post.label = label;
+            post.word_ids.assign(scratch.word_ids.begin(), scratch.word_ids.end());
+            window_count++;
+        }
+        total_posts = online.get_total_posts();
+        vocab_size = online.vocab_size();
+    }
+
+    // RETURNS: false, changing nothing, if no post with this tag and content
+        // is in the model
+    // EFFECTS: untrains one post by subtracting its counts, as if it had
+        // never been trained on. Words and labels left with no posts are
+        // dropped from the model and their memory is reused.
+    // MODIFIES: online, learning, counts, model, window, total_posts, vocab_size
+    bool forget(string_view tag, string_view content) {
+        start_learning();
+        uint32_t label = online.find_label(tag);
+        if(!online.remove_post(tag, unique_words(content), scratch.word_ids)) {
+            return false;
+        }
+        // The post must not be retired from the window a second time, so it
+        // is moved to the end of the ring and dropped
+        for(size_t i = 0; i < window_count; i++) {
+            WindowPost &post = window[(window_start + i) % window.size()];
+            if(post.label == label && post.word_ids == scratch.word_ids) {
+                for(size_t j = i; j + 1 < window_count; j++) {
+                    swap(window[(window_start + j) % window.size()], 
+                         window[(window_start + j + 1) % window.size()]);
+                }
+                window_count--;
+                break;
+            }
+        }
+        total_posts = online.get_total_posts();
+        vocab_size = online.vocab_size();
+        return true;
+    }
+
+    // RETURNS: -
+    // REQUIRES: no post has been observed yet
+    // EFFECTS: keeps only the last num_posts observed posts in the model
+        // (all of them if num_posts is 0), forgetting older ones as new
+        // ones arrive, so memory stays bounded on an endless stream
+    // MODIFIES: window_size
+    void set_window(size_t num_posts) {
+        window_size = num_posts;
+    }
+
+    // RETURNS: -
+    // EFFECTS: trains like train_classifier, but observes the posts one at a
+        // time, so scoring uses the online parameters
+    // MODIFIES: csvin, online, learning, total_posts, vocab_size
+    void train_classifier_online(CsvReader &csvin, bool echo = false) {
+        train_posts(csvin, echo, [this](string_view tag, string_view content) {
+            observe(tag, content);
+            return true;
+        });
+    }
+
+    // RETURNS: false if the training tables could not be spilled to disk
+    // EFFECTS: trains like train_classifier, but keeps the training tables
+        // under budget_bytes by spilling them to sorted runs in temporary
+        // files whenever they outgrow it; finalize() merges the runs
+    // MODIFIES: csvin, spilling, total_posts, vocab_size
+    bool train_classifier_external(CsvReader &csvin, size_t budget_bytes, 
+                                   bool echo = false) {
+        spilling.emplace(budget_bytes);
+        return train_posts(csvin, echo, [this](string_view tag, string_view content) {
+            return spilling->add_post(tag, unique_words(content));
+        });
+    }
+
+    // RETURNS: -
+    // EFFECTS: trains like train_classifier, but drops words that occur in
+        // fewer than min_df posts. Rare words are dropped in one pass as
+        // they fall behind (lossy counting), so the training tables stay
+        // bounded; finalize() drops the rest.
+    // MODIFIES: csvin, pruning, total_posts
+    void train_classifier_pruned(CsvReader &csvin, uint32_t min_df, bool echo = false) {
+        // Counts of kept words are exact up to this many posts
+        const size_t bucket_posts = 1 << 16;
+        pruning.emplace(min_df, bucket_posts);
+        train_posts(csvin, echo, [this](string_view tag, string_view content) {
+            pruning->add_post(tag, unique_words(content));
+            return true;
+        });
+    }
+
+    // RETURNS: how much finalize() pruned the vocabulary and the model
+    // REQUIRES: train_classifier_pruned() and finalize() were called
+    const PruneStats &get_prune_stats() const {
+        return prune_stats;
+    }
+
+    // RETURNS: -
+    // EFFECTS: trains like train_classifier, but counts words in Count-Min
+        // sketches with depth rows of width counters per label, so memory
+        // stays fixed however large the vocabulary grows. Scores are then
+        // approximate, and the vocabulary size is estimated.
+    // MODIFIES: csvin, sketch, sketching, total_posts, vocab_size
+    void train_classifier_sketch(CsvReader &csvin, uint32_t width, uint32_t depth,
+                                 bool echo = false) {
+        sketch = SketchModel(width, depth);
+        sketching = true;
+        train_posts(csvin, echo, [this](string_view tag, string_view content) {
+            sketch.add_post(tag, unique_words(content));
+            return true;
+        });
+        total_posts = sketch.get_total_posts();
+        vocab_size = round(sketch.estimate_vocab_size());
+    }
+
+    // RETURNS: the bytes held by the parameters used for scoring
+    // REQUIRES: finalize() was called, and observe() was not
+    size_t memory_bytes() const {
+        return sketching ? sketch.memory_bytes() : model.memory_bytes();
+    }
+
+    // RETURNS: false if spilled training tables could not be merged
+    // EFFECTS: freezes the trained counts into the read-only model used for
+        // scoring and releases the training tables. The online parameters
+        // are always up to date, so there is nothing to do once observing.
+    // MODIFIES: model, counts, spilling, pruning, prune_stats, total_posts,
+        // vocab_size
+    bool finalize() {
+        if(learning || sketching) {
+            return true;
+        }
+        if(pruning) {
+            prune_stats = pruning->finish(model);
+            pruning.reset();
+            total_posts = model.get_total_posts();
+            vocab_size = model.vocab_size();
+            return true;
+        }
+        if(spilling) {
+            bool ok = spilling->finish(model);
+            spilling.reset();
+            total_posts = model.get_total_posts();
+            vocab_size = model.vocab_size();
+            return ok;
+        }
+        model = Model(counts);
+        counts = TrainingCounts();
+        return true;
     }
 
-    // RETURNS: pair<string,double> representing post prediction and max probability score
-    // EFFECTS: calls calc_log_prob_score(string label)
+    // RETURNS: true if the model file was written
+    // REQUIRES: finalize() or observe() was called
+    // EFFECTS: saves the trained counts to model_file
     // MODIFIES: -
-    pair<string,double> predict_label() {
-        vector<pair<string,double>> prob_scores;
-        // For each label in the training data, find the log prob score of the post
-        for(const auto& label : C_w_count) {
-            prob_scores.push_back({label.first,calc_log_prob_score(label.first)});
-        }
-        double max_score = prob_scores[0].second;
-        string prediction = prob_scores[0].first;
-        for(int i = 0; i < prob_scores.size(); i++) {
-            if(prob_scores[i].second > max_score) {
-                max_score = prob_scores[i].second;
-                prediction = prob_scores[i].first;
+    bool save_model(const string &model_file) const {
+        ofstream fout(model_file, ios::binary);
+        if(learning) {
+            return fout.is_open() && Model(online.get_counts()).save(fout);
+        }
+        return fout.is_open() && model.save(fout);
+    }
+
+    // RETURNS: true if the shard was written
+    // REQUIRES: finalize() or observe() was called
+    // EFFECTS: writes the trained counts to counts_file as a shard that
+        // merge_counts can combine with shards trained on other posts
+    // MODIFIES: -
+    bool emit_counts(const string &counts_file) const {
+        if(learning) {
+            return write_run(counts_file, online.get_counts());
+        }
+        return write_run(counts_file, model);
+    }
+
+    // RETURNS: true if model_file held a valid model
+    // EFFECTS: replaces training and finalize() with the model saved in
+        // model_file, which is mapped into memory and scored in place
+    // MODIFIES: model, total_posts, vocab_size
+    bool load_model(const string &model_file) {
+        if(!model.map_file(model_file)) {
+            return false;
+        }
+        total_posts = model.get_total_posts();
+        vocab_size = model.vocab_size();
+        return true;
+    }
+
+    // RETURNS: pair<uint32_t,double> representing the predicted label ID and
+        // max probability score of a post with the given content
+    // EFFECTS: tokenizes the post once and scores every label sparsely, then
+        // calls calc_log_prob_score on the labels that could be the best so
+        // ties and rounding resolve exactly as in a full rescore
+    // MODIFIES: post
+    pair<uint32_t,double> predict(const string &content, PostScratch &post) const {
+        if(sketching) {
+            return predict_sketch(content, post);
+        }
+        resolve_words(content, post);
+        return learning ? predict_with(online, post) : predict_with(model, post);
+    }
+
+    // RETURNS: the predicted label ID and score of the post in post.word_ids,
+        // see predict
+    // EFFECTS: -
+    // MODIFIES: post.label_scores
+    template <typename Params>
+    pair<uint32_t,double> predict_with(const Params &params, PostScratch &post) const {
+        double tolerance = params.sparse_scores(post.word_ids, post.label_scores);
+
+        // Only labels that have parameters (some post with the label contained
+        // a word) can be predicted, unless no label has any (e.g. --min-df
+        // dropped every word), when every label can
+        bool any_words = params.vocab_size() > 0;
+        double best_sparse = -HUGE_VAL;
+        for(uint32_t rank = 0; rank < params.num_labels(); rank++) {
+            uint32_t label = params.label_by_rank(rank);
+            if((params.label_has_words(label) || !any_words) && 
+               post.label_scores[label] > best_sparse) {
+                best_sparse = post.label_scores[label];
+            }
+        }
+
+        uint32_t prediction = Vocabulary::npos;
+        double max_score = 0;
+        // Ties go to the label that sorts first
+        for(uint32_t rank = 0; rank < params.num_labels(); rank++) {
+            uint32_t label = params.label_by_rank(rank);
+            if((!params.label_has_words(label) && any_words) || 
+               post.label_scores[label] < best_sparse - 2 * tolerance) {
+                continue;
+            }
+            double score = calc_log_prob_score(label, post.word_ids);
+            if(prediction == Vocabulary::npos || score > max_score) {
+                max_score = score;
+                prediction = label;
+            }
+        }
+        return {prediction, max_score};
+    }
+
+    // RETURNS: the predicted label ID and score of a post with the given
+        // content under the sketch model, see predict
+    // EFFECTS: -
+    // MODIFIES: post
+    pair<uint32_t,double> predict_sketch(const string &content, PostScratch &post) const {
+        split_unique_words(content, post.words);
+        sketch.scores(post.words, post.label_scores, post.buckets);
+
+        uint32_t prediction = Vocabulary::npos;
+        double max_score = 0;
+        // Ties go to the label that sorts first
+        for(uint32_t rank = 0; rank < sketch.num_labels(); rank++) {
+            uint32_t label = sketch.label_by_rank(rank);
+            if(!sketch.label_has_words(label)) {
+                continue;
+            }
+            double score = post.label_scores[label];
+            if(prediction == Vocabulary::npos || score > max_score) {
+                max_score = score;
+                prediction = label;
             }
         }
         return {prediction, max_score};
@@ -189,102 +834,443 @@ class Classifier {
     // EFFECTS: prints line-by-line, the “correct” label, the predicted label and 
         //its log-probability score, and the content for each test. 
         //Insert a blank line after each for readability.
-    // MODIFIES: -
-    pair<int,int> test_classifier(char *argv[]) {
-        string test_file = argv[2];
-        csvstream csvin(test_file);
+        //Posts are read in batches whose predictions are spread over
+        //num_threads threads, then printed in input order.
+    // MODIFIES: csvin
+    pair<int,int> test_classifier(CsvReader &csvin, size_t num_threads = 1) {
+        csvin.project(POST_COLUMNS);
+        vector<string_view> test_row;
+        ThreadPool pool(num_threads);
+        vector<PostScratch> scratches(pool.size());
+        
+        // Per-thread tallies, summed once every batch is scored. Each sits on
+        // its own cache line so threads do not contend on them.
+        struct alignas(64) Tally {
+            int num_correct = 0;
+        };
+        vector<Tally> tallies(pool.size());
+
+        struct TestPost {
+            string tag;
+            string content;
+            pair<uint32_t,double> label_score;
+        };
+        const size_t batch_size = 1024;
+        vector<TestPost> batch(batch_size);
+        // Made once, not per batch, since wrapping the lambda allocates
+        const function<void(size_t, size_t)> predict_post = [&](size_t worker, size_t i) {
+            TestPost &test = batch[i];
+            test.label_score = predict(test.content, scratches[worker]);
+            if(test.tag == label_name(test.label_score.first)) {
+                tallies[worker].num_correct++;
+            }
+        };
  
-        int num_correct = 0;
         int num_posts = 0;
 
         cout << "test data:" << endl;
-        pair<string,double> label_score;
-        while(csvin >> correct_post) {
-            label_score = predict_label();
-            cout << "  correct = " << correct_post["tag"] << ", predicted = " <<
-                label_score.first << ", log-probability score = " <<
-                label_score.second << endl;
-            cout << "  content = " << correct_post["content"] << "\n" << endl;
-
-            if(correct_post["tag"] == label_score.first) {
-                num_correct++;
+        while(true) {
+            size_t num_read = 0;
+            while(num_read < batch_size && csvin.read_row(test_row)) {
+                batch[num_read].tag = test_row[TAG];
+                batch[num_read].content = test_row[CONTENT];
+                num_read++;
             }
-            num_posts++;
+            if(num_read == 0) {
+                break;
+            }
+
+            pool.parallel_for(num_read, predict_post);
+
+            for(size_t i = 0; i < num_read; i++) {
+                const TestPost &test = batch[i];
+                cout << "  correct = " << test.tag << ", predicted = " <<
+                    label_name(test.label_score.first) << 
+                    ", log-probability score = " << test.label_score.second << endl;
+                cout << "  content = " << test.content << "\n" << endl;
+            }
+            num_posts += num_read;
+        }
+
+        int num_correct = 0;
+        for(const Tally &tally : tallies) {
+            num_correct += tally.num_correct;
         }
         return {num_correct,num_posts};
     }
 
+    // How two classifiers' predictions on the same posts compare
+    struct Comparison {
+        int num_correct = 0; // posts this classifier labeled correctly
+        int num_other_correct = 0; // posts the other classifier labeled correctly
+        int num_agreed = 0; // posts both gave the same label
+        int num_posts = 0;
+        double test_ms = 0; // time this classifier spent predicting
+        double other_test_ms = 0; // time the other classifier spent predicting
+    };
+
+    // RETURNS: how often this classifier and other predict the correct label
+        // of the posts of csvin, and how often they predict the same one
+    // REQUIRES: finalize() was called on both classifiers
+    // EFFECTS: -
+    // MODIFIES: csvin
+    Comparison compare_classifier(CsvReader &csvin, const Classifier &other) const {
+        csvin.project(POST_COLUMNS);
+        vector<string_view> test_row;
+        PostScratch post;
+        string content;
+        Comparison result;
+        while(csvin.read_row(test_row)) {
+            content = test_row[CONTENT];
+            auto start = chrono::steady_clock::now();
+            string_view label = label_name(predict(content, post).first);
+            result.test_ms += elapsed_ms(start);
+            start = chrono::steady_clock::now();
+            string_view other_label = other.label_name(other.predict(content, post).first);
+            result.other_test_ms += elapsed_ms(start);
+            result.num_correct += label == test_row[TAG];
+            result.num_other_correct += other_label == test_row[TAG];
+            result.num_agreed += label == other_label;
+            result.num_posts++;
+        }
+        return result;
+    }
+
 };
 
-void check_command_line(int argc,char *argv[]) {
-    bool correct_argc = false;
-    if(argc == 3 || argc == 4) {correct_argc = true;}
-    bool correct_debug = true;
-    if (argc == 4) {
-        string debug = argv[3];
-        if(debug != "--debug") {
-            correct_debug = false;
+struct Options {
+    string train_file; // empty with --load-model
+    string test_file; // may be empty with --save-model
+    bool debug = false; // --debug: print training data and model parameters
+    bool timing = false; // --timing: report stage timings on stderr
+    string save_model; // --save-model PATH: write the trained model to PATH
+    string load_model; // --load-model PATH: read the model instead of training
+    string emit_counts; // --emit-counts PATH: write the trained counts to PATH
+    size_t threads = 1; // --threads N: train and test on N threads
+    bool online = false; // --online: train and score with observe()
+    size_t window = 0; // --window N: train online on the last N posts only
+    size_t memory_budget = 0; // --memory-budget MB: spill training tables past MB
+    // --pipeline: train with N tokenizer threads between a parser and a
+    // counter; also used for --threads N when TRAIN_FILE is a pipe or "-"
+    bool pipeline = false;
+    // --sketch WIDTHxDEPTH: train Count-Min sketches of depth rows of width
+    // counters instead of exact counts
+    uint32_t sketch_width = 0;
+    uint32_t sketch_depth = 0;
+    // --hash-bits K: the hashing trick, a sketch of one row of 2^K buckets
+    int hash_bits = 0;
+    uint32_t min_df = 0; // --min-df K: drop words in fewer than K posts
+    // --compare: train both the exact model and the sketch, and report the
+    // accuracy and timings of each on TEST_FILE instead of the test output
+    bool compare = false;
+};
+
+// RETURNS: true if the command line is valid
+// EFFECTS: prints the usage message if it is not
+// MODIFIES: opts
+bool check_command_line(int argc, char *argv[], Options &opts) {
+    vector<string> positional;
+    bool correct_flags = true;
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if(arg == "--debug") {
+            opts.debug = true;
+        }
+        else if(arg == "--timing") {
+            opts.timing = true;
+        }
+        else if(arg == "--pipeline") {
+            opts.pipeline = true;
+        }
+        else if(arg == "--online") {
+            opts.online = true;
+        }
+        else if(arg == "--compare") {
+            opts.compare = true;
+        }
+        else if(arg == "--sketch" && i + 1 < argc) {
+            unsigned width = 0;
+            unsigned depth = 0;
+            char end = 0;
+            bool parsed = sscanf(argv[++i], "%ux%u%c", &width, &depth, &end) == 2;
+            correct_flags = correct_flags && parsed && width > 0 && depth > 0;
+            opts.sketch_width = width;
+            opts.sketch_depth = depth;
         }
+        else if(arg == "--min-df" && i + 1 < argc) {
+            int min_df = atoi(argv[++i]);
+            correct_flags = correct_flags && min_df > 0;
+            opts.min_df = min_df > 0 ? min_df : 0;
+        }
+        else if(arg == "--hash-bits" && i + 1 < argc) {
+            int bits = atoi(argv[++i]);
+            correct_flags = correct_flags && bits > 0 && bits <= 28;
+            opts.hash_bits = bits;
+            opts.sketch_width = bits > 0 && bits <= 28 ? 1u << bits : 0;
+            opts.sketch_depth = 1;
+        }
+        else if(arg == "--memory-budget" && i + 1 < argc) {
+            int megabytes = atoi(argv[++i]);
+            correct_flags = correct_flags && megabytes > 0;
+            opts.memory_budget = megabytes > 0 ? size_t(megabytes) << 20 : 0;
+        }
+        else if(arg == "--window" && i + 1 < argc) {
+            int window = atoi(argv[++i]);
+            correct_flags = correct_flags && window > 0;
+            opts.window = window > 0 ? window : 0;
+            opts.online = true;
+        }
+        else if(arg == "--save-model" && i + 1 < argc) {
+            opts.save_model = argv[++i];
+        }
+        else if(arg == "--emit-counts" && i + 1 < argc) {
+            opts.emit_counts = argv[++i];
+        }
+        else if(arg == "--load-model" && i + 1 < argc) {
+            opts.load_model = argv[++i];
+        }
+        else if(arg == "--threads" && i + 1 < argc) {
+            int threads = atoi(argv[++i]);
+            correct_flags = correct_flags && threads > 0;
+            opts.threads = threads > 0 ? threads : 1;
+        }
+        else if(arg.compare(0, 2, "--") == 0) {
+            correct_flags = false;
+        }
+        else {
+            positional.push_back(arg);
+        }
+    }
+
+    // A loaded model needs no TRAIN_FILE; a saved one (or its counts) needs
+    // no TEST_FILE
+    size_t num_train = opts.load_model.empty() ? 1 : 0;
+    bool correct_files = positional.size() == num_train + 1 || 
+        (positional.size() == num_train && 
+         (!opts.save_model.empty() || !opts.emit_counts.empty()));
+
+    // A sketch is a separate mode that keeps no words, so it cannot be
+    // saved, and --compare needs one to compare against, and both files
+    bool sketching = opts.sketch_width > 0;
+    correct_flags = correct_flags && (!sketching || 
+        (opts.save_model.empty() && opts.emit_counts.empty() && opts.load_model.empty() && 
+         !opts.online && opts.memory_budget == 0));
+    // --min-df trains exact counts its own way
+    correct_flags = correct_flags && (opts.min_df == 0 || 
+        (!sketching && !opts.online && opts.memory_budget == 0 && opts.load_model.empty()));
+    // --memory-budget and --min-df train on one thread, and not online
+    correct_flags = correct_flags && ((opts.memory_budget == 0 && opts.min_df == 0) ||
+        (!opts.online && opts.threads == 1 && !opts.pipeline));
+    correct_flags = correct_flags && (!opts.compare || 
+        (sketching && num_train == 1 && positional.size() == 2));
+
+    if(!correct_files || !correct_flags) {
+        cout << "Usage: main.exe TRAIN_FILE TEST_FILE [--debug] [--timing] [--threads N] [--pipeline]" << endl;
+        cout << "                [--online] [--window N] [--memory-budget MB] [--min-df K]" << endl;
+        cout << "       main.exe TRAIN_FILE TEST_FILE --sketch WIDTHxDEPTH [--compare] [...]" << endl;
+        cout << "       main.exe TRAIN_FILE TEST_FILE --hash-bits K [--compare] [...]" << endl;
+        cout << "       main.exe TRAIN_FILE [TEST_FILE] --save-model MODEL_FILE [...]" << endl;
+        cout << "       main.exe TRAIN_FILE [TEST_FILE] --emit-counts COUNTS_FILE [...]" << endl;
+        cout << "       main.exe --load-model MODEL_FILE TEST_FILE [...]" << endl;
+        return false;
     }
+    if(num_train == 1) {
+        opts.train_file = positional[0];
+    }
+    if(positional.size() > num_train) {
+        opts.test_file = positional[num_train];
+    }
+    return true;
+}
 
-    if(!correct_argc || !correct_debug) {
-        cout << "Usage: main.exe TRAIN_FILE TEST_FILE [--debug]" << endl;
+// RETURNS: false if file could not be opened
+// EFFECTS: opens file into csvin, unless file is empty; prints an error if
+//          it cannot be opened
+// MODIFIES: csvin
+bool open_csv(const string &file, optional<CsvReader> &csvin) {
+    if(file.empty()) {
+        return true;
+    }
+    try {
+        csvin.emplace(file);
     }
+    catch(const csvstream_exception &) {
+        cout << "Error opening file: " << file << endl;
+        return false;
+    }
+    return true;
+}
+
+// RETURNS: 0, or 1 if TRAIN_FILE cannot be read a second time
+// EFFECTS: trains the sketch opts asks for on TRAIN_FILE, predicts every post
+//          of test_in with it and with exact, and prints the accuracy of
+//          each, how often they agree, the size of each model, and the
+//          time each took to train (exact_train_ms for exact) and to test
+// MODIFIES: test_in
+int report_comparison(const Classifier &exact, double exact_train_ms, const Options &opts, 
+                      CsvReader &test_in) {
+    optional<CsvReader> train_in;
+    if(!open_csv(opts.train_file, train_in)) {
+        return 1;
+    }
+    Classifier approx;
+    auto start = chrono::steady_clock::now();
+    approx.train_classifier_sketch(*train_in, opts.sketch_width, opts.sketch_depth);
+    double approx_train_ms = elapsed_ms(start);
+    Classifier::Comparison result = exact.compare_classifier(test_in, approx);
+
+    // Timings of a second or more would otherwise print in e-notation
+    cout << fixed;
+    cout.precision(2);
+
+    cout << "exact: " << result.num_correct << " / " << result.num_posts 
+        << " posts predicted correctly, " << exact.memory_bytes() << " bytes, train " 
+        << exact_train_ms << " ms, test " << result.test_ms << " ms" << endl;
+    if(opts.hash_bits > 0) {
+        cout << "hashed 2^" << opts.hash_bits << ": ";
+    }
+    else {
+        cout << "sketch " << opts.sketch_width << "x" << opts.sketch_depth << ": ";
+    }
+    cout << result.num_other_correct << " / " << result.num_posts 
+        << " posts predicted correctly, " << approx.memory_bytes() << " bytes, train " 
+        << approx_train_ms << " ms, test " << result.other_test_ms << " ms" << endl;
+    cout << "agreement: " << result.num_agreed << " / " << result.num_posts 
+        << " posts predicted the same" << endl;
+    if(result.num_posts > 0) {
+        cout << "accuracy loss: " 
+            << 100.0 * (result.num_correct - result.num_other_correct) / result.num_posts
+            << "%" << endl;
+    }
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
     cout.precision(3);
     Classifier classifier;
 
-    check_command_line(argc,argv);
+    Options opts;
+    if(!check_command_line(argc, argv, opts)) {
+        return 1;
+    }
 
-    string train_file = argv[1];
-    string test_file = argv[2];
-    ifstream fin(train_file);
-    ifstream fin2(test_file);
-    if(!fin.is_open()) {
-        cout << "Error opening file: " << train_file << endl;
+    string train_file = opts.train_file;
+    string test_file = opts.test_file;
+    // Both files are opened (and their headers read) before anything is
+    // printed, and each is then parsed exactly once
+    optional<CsvReader> train_in;
+    optional<CsvReader> test_in;
+    if(!open_csv(train_file, train_in) || !open_csv(test_file, test_in)) {
         return 1;
     }
-    if(!fin2.is_open()) {
-        cout << "Error opening file: " << test_file << endl;
+    // --compare trains twice, so it reads TRAIN_FILE twice
+    if(opts.compare && train_in->streamed()) {
+        cout << "Error: --compare cannot reread " << train_file << endl;
         return 1;
     }
 
-    if(argc == 4) {
-        string debug = argv[3];
-        if(debug == "--debug") {
-            classifier.print_label_content(argc,argv);
+    double train_ms = 0;
+    double finalize_ms = 0;
+    auto start = chrono::steady_clock::now();
+    if(!opts.load_model.empty()) {
+        if(!classifier.load_model(opts.load_model)) {
+            cout << "Error reading model: " << opts.load_model << endl;
+            return 1;
         }
+        finalize_ms = elapsed_ms(start);
     }
+    else {
+        if(opts.memory_budget > 0) {
+            if(!classifier.train_classifier_external(*train_in, opts.memory_budget, 
+                                                     opts.debug)) {
+                cout << "Error writing temporary files" << endl;
+                return 1;
+            }
+        }
+        else if(opts.min_df > 0) {
+            classifier.train_classifier_pruned(*train_in, opts.min_df, opts.debug);
+        }
+        else if(opts.sketch_width > 0 && !opts.compare) {
+            classifier.train_classifier_sketch(*train_in, opts.sketch_width, 
+                                               opts.sketch_depth, opts.debug);
+        }
+        else if(opts.online) {
+            classifier.set_window(opts.window);
+            classifier.train_classifier_online(*train_in, opts.debug);
+        }
+        else if(opts.pipeline || (opts.threads > 1 && train_in->streamed())) {
+            classifier.train_classifier_pipelined(*train_in, opts.threads, opts.debug);
+        }
+        else if(opts.threads > 1) {
+            classifier.train_classifier_parallel(*train_in, opts.threads, opts.debug);
+        }
+        else {
+            classifier.train_classifier(*train_in, opts.debug);
+        }
+        train_ms = elapsed_ms(start);
 
-    classifier.train_classifier(argc,argv);
+        // Building the log tables is startup cost paid once per run, reported
+        // apart from training itself
+        start = chrono::steady_clock::now();
+        if(!classifier.finalize()) {
+            cout << "Error reading temporary files" << endl;
+            return 1;
+        }
+        finalize_ms = elapsed_ms(start);
+    }
+
+    // Reported on stderr like --timing, so the output itself is unchanged
+    if(opts.min_df > 0) {
+        const PruneStats &stats = classifier.get_prune_stats();
+        cerr << "min-df " << opts.min_df << ": vocabulary about " << round(stats.words_seen)
+            << " -> " << stats.words_kept << " words, postings about " 
+            << stats.postings_kept + stats.postings_dropped << " -> " << stats.postings_kept 
+            << ", model " << classifier.memory_bytes() << " bytes" << endl;
+    }
+
+    if(!opts.save_model.empty() && !classifier.save_model(opts.save_model)) {
+        cout << "Error writing model: " << opts.save_model << endl;
+        return 1;
+    }
+    if(!opts.emit_counts.empty() && !classifier.emit_counts(opts.emit_counts)) {
+        cout << "Error writing counts: " << opts.emit_counts << endl;
+        return 1;
+    }
 
     cout << "trained on " << classifier.get_total_posts() << " examples" << endl;
 
-    if(argc == 4) {
-        string debug = argv[3];
-        if(debug == "--debug") {
-            cout << "vocabulary size = " << classifier.get_vocab_size() << endl;
-        }
+    if(opts.debug) {
+        cout << "vocabulary size = " << classifier.get_vocab_size() << endl;
     }
 
     cout << "\n";
 
-    if(argc == 4) {
-        string debug = argv[3];
-        if(debug == "--debug") {
-            classifier.print_debug_data(argc,argv);
-        }
+    if(opts.debug) {
+        classifier.print_debug_data();
     }
 
-    pair<int,int> result = classifier.test_classifier(argv);
+    if(opts.compare) {
+        return report_comparison(classifier, train_ms + finalize_ms, opts, *test_in);
+    }
 
-    cout << "performance: " << result.first << " / " 
-    << result.second << " posts predicted correctly";
+    double test_ms = 0;
+    if(!test_file.empty()) {
+        start = chrono::steady_clock::now();
+        pair<int,int> result = classifier.test_classifier(*test_in, opts.threads);
+        test_ms = elapsed_ms(start);
 
-    cout << "\n";
+        cout << "performance: " << result.first << " / " 
+        << result.second << " posts predicted correctly";
+
+        cout << "\n";
+    }
+
+    if(opts.timing) {
+        cerr << "timing: train " << train_ms << " ms, " 
+            << (opts.load_model.empty() ? "finalize (log tables) " : "load model ")
+            << finalize_ms << " ms, test " << test_ms << " ms, peak RSS " 
+            << peak_rss_mb() << " MB" << endl;
+    }
 
     return 0;
 }
- 
\ No newline at end of file
@@ -0,0 +1,38 @@
+/* Combines the counts of classifiers trained on separate parts of the data,
+e.g. one per course or per term, each on its own machine or process. Each
+part is trained with main.exe TRAIN_FILE --emit-counts COUNTS_FILE, and
+this program k-way merges any number of those shards into one model file,
+the same model main.exe --save-model would write if trained on all the
+parts' CSVs one after another. Use it with main.exe --load-model. */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "model.h"
+#include "spill.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+    if(argc < 3) {
+        cout << "Usage: merge_counts.exe MODEL_FILE COUNTS_FILE..." << endl;
+        return 1;
+    }
+    string model_file = argv[1];
+    vector<string> shards(argv + 2, argv + argc);
+
+    Model model;
+    if(!build_model(shards, false, model)) {
+        cout << "Error reading counts" << endl;
+        return 1;
+    }
+    ofstream fout(model_file, ios::binary);
+    if(!fout.is_open() || !model.save(fout)) {
+        cout << "Error writing model: " << model_file << endl;
+        return 1;
+    }
+    cout << "merged " << shards.size() << " shards: " << uint64_t(model.get_total_posts())
+        << " posts, " << model.vocab_size() << " words" << endl;
+    return 0;
+}
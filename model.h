@@ -0,0 +1,611 @@
+/* The trained classifier parameters, frozen into a read-only form for scoring.
+Words and labels are renumbered in sorted order, so iterating IDs from 0 walks
+them the way the original std::map<string,...> tables did. Every query is
+const: scoring a post can never insert into or grow the model.
+
+The log-prior and log-likelihood of every trained parameter is computed once
+when the model is built, so scoring a post is only table lookups and sums.
+Only nonzero C_w_count entries are stored, as per-word postings lists.
+
+The whole model lives in one flat image of 8-byte aligned arrays, which is
+also the model file format: save() writes the image as is, and map_file()
+mmaps a saved image read-only and scores straight from the mapping, with no
+parsing and no per-entry allocation. Processes mapping the same file share
+its pages through the page cache. The image starts with a ModelHeader that
+gives the byte offset of every array:
+    label_names[L + 1]             u64 offsets of label strings in string_pool
+    label_count[L]                 u32
+    label_num_words[L]             u32, num words seen with the label
+    label_log_prior[L]             double
+    word_names[V + 1]              u64 offsets of word strings in string_pool
+    word_count[V]                  u32
+    word_log_fallback[V]           double
+    word_postings[V + 1]           u32, postings of w are [w_p[w], w_p[w + 1])
+    posting_label[P]               u32, sorted within each word
+    posting_count[P]               u32
+    posting_log_likelihood[P]      double
+    posting_delta[P]               double
+    hash_index[S]                  u32 word IDs by FNV-1a hash, UINT32_MAX if
+                                   empty; linear probing, S a power of two
+    string_pool                    label strings, then word strings
+Arrays are in native byte order; header.byte_order rejects foreign files. */
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <math.h>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "counts.h"
+#include "vocabulary.h"
+
+struct ModelHeader {
+    char magic[8]; // "PZMODEL3"
+    uint32_t byte_order; // 0x01020304 as written by the saving machine
+    uint32_t num_labels;
+    uint32_t num_words;
+    uint32_t num_postings;
+    uint32_t hash_slots;
+    uint32_t reserved;
+    uint64_t total_posts;
+    uint64_t string_pool_size;
+    uint64_t image_size;
+    // Byte offsets of the arrays from the start of the image
+    uint64_t label_names, label_count, label_num_words, label_log_prior;
+    uint64_t word_names, word_count, word_log_fallback, word_postings;
+    uint64_t posting_label, posting_count, posting_log_likelihood, posting_delta;
+    uint64_t hash_index, string_pool;
+};
+
+class Model {
+    private:
+    // The image is either owned (built by finalize) or a read-only mapping
+    std::vector<uint64_t> owned;
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+
+    // Views into the image, see the layout at the top of the file
+    const ModelHeader *header = nullptr;
+    const uint64_t *label_names = nullptr;
+    const uint32_t *label_count = nullptr;
+    const uint32_t *label_num_words = nullptr;
+    const double *label_log_prior = nullptr;
+    const uint64_t *word_names = nullptr;
+    const uint32_t *word_count = nullptr;
+    const double *word_log_fallback = nullptr;
+    const uint32_t *word_postings = nullptr;
+    const uint32_t *posting_label = nullptr;
+    const uint32_t *posting_count = nullptr;
+    const double *posting_log_likelihood = nullptr;
+    const double *posting_delta = nullptr;
+    const uint32_t *hash_index = nullptr;
+    const char *string_pool = nullptr;
+    double log_unseen = 0; // log(1 / total_posts), for words not in training
+
+    static constexpr uint32_t byte_order_mark = 0x01020304;
+
+    static uint64_t align8(uint64_t offset) {
+        return (offset + 7) & ~uint64_t(7);
+    }
+
+    // RETURNS: the FNV-1a hash of str, which must not change between builds
+    //          since it is stored in model files
+    static uint64_t hash_word(std::string_view str) {
+        uint64_t hash = 14695981039346656037ull;
+        for(char c : str) {
+            hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // RETURNS: a header with every array offset filled in for these sizes
+    static ModelHeader layout(uint32_t num_labels, uint32_t num_words,
+                              uint32_t num_postings, uint32_t hash_slots,
+                              uint64_t string_pool_size) {
+        ModelHeader h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, "PZMODEL3", 8);
+        h.byte_order = byte_order_mark;
+        h.num_labels = num_labels;
+        h.num_words = num_words;
+        h.num_postings = num_postings;
+        h.hash_slots = hash_slots;
+        h.string_pool_size = string_pool_size;
+
+        uint64_t offset = align8(sizeof(ModelHeader));
+        auto place = [&offset](uint64_t &field, uint64_t bytes) {
+            field = offset;
+            offset = align8(offset + bytes);
+        };
+        place(h.label_names, (uint64_t(num_labels) + 1) * 8);
+        place(h.label_count, uint64_t(num_labels) * 4);
+        place(h.label_num_words, uint64_t(num_labels) * 4);
+        place(h.label_log_prior, uint64_t(num_labels) * 8);
+        place(h.word_names, (uint64_t(num_words) + 1) * 8);
+        place(h.word_count, uint64_t(num_words) * 4);
+        place(h.word_log_fallback, uint64_t(num_words) * 8);
+        place(h.word_postings, (uint64_t(num_words) + 1) * 4);
+        place(h.posting_label, uint64_t(num_postings) * 4);
+        place(h.posting_count, uint64_t(num_postings) * 4);
+        place(h.posting_log_likelihood, uint64_t(num_postings) * 8);
+        place(h.posting_delta, uint64_t(num_postings) * 8);
+        place(h.hash_index, uint64_t(hash_slots) * 4);
+        place(h.string_pool, string_pool_size);
+        h.image_size = offset;
+        return h;
+    }
+
+    // RETURNS: true if image holds a model image whose header matches its size
+    // EFFECTS: points the array views into image
+    // MODIFIES: the views
+    bool attach(const char *image, size_t size) {
+        if(size < sizeof(ModelHeader)) {
+            return false;
+        }
+        const ModelHeader *h = (const ModelHeader *)image;
+        if(memcmp(h->magic, "PZMODEL3", 8) != 0 || h->byte_order != byte_order_mark ||
+           h->image_size != size ||
+           (h->hash_slots & (h->hash_slots - 1)) != 0 || h->hash_slots <= h->num_words) {
+            return false;
+        }
+        // Every offset follows from the sizes, so one comparison checks them all
+        ModelHeader expected = layout(h->num_labels, h->num_words, h->num_postings,
+                                      h->hash_slots, h->string_pool_size);
+        expected.total_posts = h->total_posts;
+        if(memcmp(&expected, h, sizeof(ModelHeader)) != 0) {
+            return false;
+        }
+
+        header = h;
+        label_names = (const uint64_t *)(image + h->label_names);
+        label_count = (const uint32_t *)(image + h->label_count);
+        label_num_words = (const uint32_t *)(image + h->label_num_words);
+        label_log_prior = (const double *)(image + h->label_log_prior);
+        word_names = (const uint64_t *)(image + h->word_names);
+        word_count = (const uint32_t *)(image + h->word_count);
+        word_log_fallback = (const double *)(image + h->word_log_fallback);
+        word_postings = (const uint32_t *)(image + h->word_postings);
+        posting_label = (const uint32_t *)(image + h->posting_label);
+        posting_count = (const uint32_t *)(image + h->posting_count);
+        posting_log_likelihood = (const double *)(image + h->posting_log_likelihood);
+        posting_delta = (const double *)(image + h->posting_delta);
+        hash_index = (const uint32_t *)(image + h->hash_index);
+        string_pool = image + h->string_pool;
+        log_unseen = log(1 / double(h->total_posts));
+        return true;
+    }
+
+    // RETURNS: -
+    // EFFECTS: fills the log tables of an owned image from its counts
+    // MODIFIES: label_log_prior, word_log_fallback, posting_log_likelihood,
+    //           posting_delta
+    void build_log_tables() {
+        double *prior = (double *)label_log_prior;
+        double *fallback = (double *)word_log_fallback;
+        double *likelihood = (double *)posting_log_likelihood;
+        double *delta = (double *)posting_delta;
+        double total_posts = get_total_posts();
+
+        for(uint32_t label = 0; label < num_labels(); label++) {
+            prior[label] = log(label_count[label] / total_posts);
+        }
+        for(uint32_t w = 0; w < vocab_size(); w++) {
+            fallback[w] = log(word_count[w] / total_posts);
+            for(uint32_t p = word_postings[w]; p < word_postings[w + 1]; p++) {
+                likelihood[p] = log(double(posting_count[p]) / label_count[posting_label[p]]);
+                delta[p] = likelihood[p] - fallback[w];
+            }
+        }
+    }
+
+    // RETURNS: the index of the posting for (label, word), or UINT32_MAX
+    uint32_t find_posting(uint32_t label, uint32_t word) const {
+        if(word == Vocabulary::npos) {
+            return UINT32_MAX;
+        }
+        const uint32_t *first = posting_label + word_postings[word];
+        const uint32_t *last = posting_label + word_postings[word + 1];
+        const uint32_t *it = std::lower_bound(first, last, label);
+        if(it == last || *it != label) {
+            return UINT32_MAX;
+        }
+        return uint32_t(it - posting_label);
+    }
+
+    // RETURNS: -
+    // EFFECTS: unmaps or frees the image and clears the views
+    // MODIFIES: the model
+    void release() {
+        *this = Model();
+    }
+
+    public:
+    Model() = default;
+    Model(const Model &) = delete;
+    Model &operator=(const Model &) = delete;
+
+    Model(Model &&other) noexcept {
+        *this = std::move(other);
+    }
+
+    Model &operator=(Model &&other) noexcept {
+        if(this == &other) {
+            return *this;
+        }
+        if(mapping) {
+            munmap(mapping, mapping_size);
+        }
+        // Moving the vector keeps its buffer, so the views stay valid
+        owned = std::move(other.owned);
+        mapping = other.mapping;
+        mapping_size = other.mapping_size;
+        header = other.header;
+        label_names = other.label_names;
+        label_count = other.label_count;
+        label_num_words = other.label_num_words;
+        label_log_prior = other.label_log_prior;
+        word_names = other.word_names;
+        word_count = other.word_count;
+        word_log_fallback = other.word_log_fallback;
+        word_postings = other.word_postings;
+        posting_label = other.posting_label;
+        posting_count = other.posting_count;
+        posting_log_likelihood = other.posting_log_likelihood;
+        posting_delta = other.posting_delta;
+        hash_index = other.hash_index;
+        string_pool = other.string_pool;
+        log_unseen = other.log_unseen;
+        other.mapping = nullptr;
+        other.header = nullptr;
+        return *this;
+    }
+
+    ~Model() {
+        if(mapping) {
+            munmap(mapping, mapping_size);
+        }
+    }
+
+    // RETURNS: false, leaving the model empty, if the words do not match
+    //          the sizes given or are not in strictly increasing order, if a
+    //          label ID is out of range or repeated within a word, or if
+    //          next_word fails
+    // EFFECTS: builds an owned image from counts that arrive one word at a
+    //          time: next_word(word, postings) returns false on failure, and
+    //          otherwise sets the next word in sorted order and its (label
+    //          ID, C_w_count) pairs, label IDs being those of labels.
+    //          num_words, num_postings and word_bytes (the total length of
+    //          the words) size the image up front, so the words never have
+    //          to be held in memory all at once. Every write is checked
+    //          against those sizes first, so they need not be trusted.
+    // MODIFIES: the model
+    template <typename NextWord>
+    bool build(const Vocabulary &train_labels, const std::vector<uint32_t> &train_label_count,
+               uint64_t total_posts, uint32_t num_words, uint32_t num_postings,
+               uint64_t word_bytes, NextWord next_word) {
+        std::vector<uint32_t> label_order = train_labels.sorted_ids();
+        uint32_t num_labels = uint32_t(label_order.size());
+
+        // new_label_id[old ID] = sorted ID
+        std::vector<uint32_t> new_label_id(train_labels.id_limit());
+        uint64_t pool_size = word_bytes;
+        for(uint32_t label = 0; label < num_labels; label++) {
+            new_label_id[label_order[label]] = label;
+            pool_size += train_labels.name(label_order[label]).size();
+        }
+        // At most half full, so probing always reaches an empty slot quickly
+        uint32_t hash_slots = 2;
+        while(hash_slots < 2 * uint64_t(num_words) + 1) {
+            hash_slots *= 2;
+        }
+
+        ModelHeader h = layout(num_labels, num_words, num_postings, hash_slots, pool_size);
+        h.total_posts = total_posts;
+        owned.assign(h.image_size / 8, 0);
+        char *image = (char *)owned.data();
+        memcpy(image, &h, sizeof(h));
+        attach(image, h.image_size);
+
+        uint64_t *names = (uint64_t *)label_names;
+        uint32_t *values = (uint32_t *)label_count;
+        char *pool = (char *)string_pool;
+        uint64_t pool_used = 0;
+        for(uint32_t label = 0; label < num_labels; label++) {
+            std::string_view name = train_labels.name(label_order[label]);
+            names[label] = pool_used;
+            memcpy(pool + pool_used, name.data(), name.size());
+            pool_used += name.size();
+            values[label] = train_label_count[label_order[label]];
+        }
+        names[num_labels] = pool_used;
+
+        names = (uint64_t *)word_names;
+        values = (uint32_t *)word_count;
+        uint32_t *num_label_words = (uint32_t *)label_num_words;
+        uint32_t *postings = (uint32_t *)word_postings;
+        uint32_t *label_ids = (uint32_t *)posting_label;
+        uint32_t *counts = (uint32_t *)posting_count;
+        uint32_t *index = (uint32_t *)hash_index;
+        std::fill(index, index + hash_slots, UINT32_MAX);
+        std::string name, prev_name;
+        std::vector<std::pair<uint32_t, uint32_t>> word_postings_in;
+        uint32_t p = 0;
+        for(uint32_t w = 0; w < num_words; w++) {
+            if(!next_word(name, word_postings_in) || (w > 0 && name <= prev_name) ||
+               name.size() > pool_size - pool_used || 
+               word_postings_in.size() > num_postings - p) {
+                release();
+                return false;
+            }
+            names[w] = pool_used;
+            memcpy(pool + pool_used, name.data(), name.size());
+            pool_used += name.size();
+
+            uint32_t slot = uint32_t(hash_word(name)) & (hash_slots - 1);
+            while(index[slot] != UINT32_MAX) {
+                slot = (slot + 1) & (hash_slots - 1);
+            }
+            index[slot] = w;
+
+            // Postings are kept sorted by sorted label ID; word_count is the
+            // number of posts containing w, whatever their label
+            for(std::pair<uint32_t, uint32_t> &posting : word_postings_in) {
+                // Erased label IDs are not in label_order
+                if(posting.first >= new_label_id.size() || 
+                   new_label_id[posting.first] >= num_labels ||
+                   label_order[new_label_id[posting.first]] != posting.first) {
+                    release();
+                    return false;
+                }
+                posting.first = new_label_id[posting.first];
+            }
+            std::sort(word_postings_in.begin(), word_postings_in.end());
+            postings[w] = p;
+            values[w] = 0;
+            for(const std::pair<uint32_t, uint32_t> &posting : word_postings_in) {
+                if(p > postings[w] && label_ids[p - 1] == posting.first) {
+                    release();
+                    return false;
+                }
+                label_ids[p] = posting.first;
+                counts[p] = posting.second;
+                values[w] += posting.second;
+                num_label_words[posting.first]++;
+                p++;
+            }
+            prev_name.swap(name);
+        }
+        if(pool_used != pool_size || p != num_postings) {
+            release();
+            return false;
+        }
+        names[num_words] = pool_used;
+        postings[num_words] = p;
+
+        build_log_tables();
+        return true;
+    }
+
+    // EFFECTS: freezes the training counts into an owned image
+    explicit Model(const TrainingCounts &counts) {
+        std::vector<uint32_t> word_order = counts.words.sorted_ids();
+        // The postings of every word, already in sorted label order
+        std::vector<uint32_t> first;
+        std::vector<std::pair<uint32_t, uint32_t>> all_postings;
+        counts.word_postings(counts.labels.sorted_ids(), first, all_postings);
+        uint64_t word_bytes = 0;
+        for(uint32_t word : word_order) {
+            word_bytes += counts.words.name(word).size();
+        }
+
+        size_t next = 0;
+        build(counts.labels, counts.label_count, counts.total_posts,
+              uint32_t(word_order.size()), uint32_t(all_postings.size()), word_bytes,
+              [&](std::string &name, std::vector<std::pair<uint32_t, uint32_t>> &postings) {
+                  uint32_t word = word_order[next++];
+                  name = counts.words.name(word);
+                  postings.assign(all_postings.begin() + first[word], 
+                                  all_postings.begin() + first[word + 1]);
+                  return true;
+              });
+    }
+
+    // RETURNS: true if the model was written successfully
+    // EFFECTS: writes the image to out
+    // MODIFIES: out
+    bool save(std::ostream &out) const {
+        out.write((const char *)header, header->image_size);
+        return bool(out);
+    }
+
+    // RETURNS: true if model_file holds a valid model image
+    // EFFECTS: replaces the model with a read-only mapping of model_file
+    // MODIFIES: the model
+    bool map_file(const std::string &model_file) {
+        release();
+        int fd = open(model_file.c_str(), O_RDONLY);
+        if(fd < 0) {
+            return false;
+        }
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        close(fd);
+        if(addr == MAP_FAILED) {
+            return false;
+        }
+        mapping = addr;
+        mapping_size = st.st_size;
+        if(!attach((const char *)addr, mapping_size)) {
+            release();
+            return false;
+        }
+        return true;
+    }
+
+    double get_total_posts() const {
+        return header ? double(header->total_posts) : 0;
+    }
+
+    size_t num_labels() const {
+        return header ? header->num_labels : 0;
+    }
+
+    size_t vocab_size() const {
+        return header ? header->num_words : 0;
+    }
+
+    // RETURNS: the bytes of the image, which holds the whole model
+    size_t memory_bytes() const {
+        return header ? header->image_size : 0;
+    }
+
+    // RETURNS: the ID of the label that sorts rank-th by name, which is rank
+    //          itself since labels are numbered in sorted order
+    uint32_t label_by_rank(uint32_t rank) const {
+        return rank;
+    }
+
+    // RETURNS: every word ID, in sorted order of the words
+    std::vector<uint32_t> sorted_word_ids() const {
+        std::vector<uint32_t> order(vocab_size());
+        for(uint32_t w = 0; w < order.size(); w++) {
+            order[w] = w;
+        }
+        return order;
+    }
+
+    // RETURNS: the counts the model was built from, with IDs in sorted order,
+    //          so a loaded model can be trained further
+    TrainingCounts to_counts() const {
+        TrainingCounts counts;
+        counts.total_posts = header->total_posts;
+        for(uint32_t label = 0; label < num_labels(); label++) {
+            counts.intern_label(label_name(label));
+            counts.label_count[label] = label_count[label];
+        }
+        for(uint32_t w = 0; w < vocab_size(); w++) {
+            counts.intern_word(word_name(w));
+            for(uint32_t p = word_postings[w]; p < word_postings[w + 1]; p++) {
+                counts.add_word(posting_label[p], w, posting_count[p]);
+            }
+        }
+        return counts;
+    }
+
+    // RETURNS: the ID of word, or Vocabulary::npos if it never occurred in training
+    uint32_t find_word(std::string_view word) const {
+        uint32_t mask = header->hash_slots - 1;
+        for(uint32_t slot = uint32_t(hash_word(word)) & mask; ; slot = (slot + 1) & mask) {
+            uint32_t id = hash_index[slot];
+            if(id == UINT32_MAX || word_name(id) == word) {
+                return id;
+            }
+        }
+    }
+
+    std::string_view label_name(uint32_t label) const {
+        return std::string_view(string_pool + label_names[label],
+                                label_names[label + 1] - label_names[label]);
+    }
+
+    std::string_view word_name(uint32_t word) const {
+        return std::string_view(string_pool + word_names[word],
+                                word_names[word + 1] - word_names[word]);
+    }
+
+    double get_label_count(uint32_t label) const {
+        return label_count[label];
+    }
+
+    // RETURNS: -
+    // EFFECTS: sets postings to the (label ID, C_w_count) pairs of word, by
+    //          label ID
+    // MODIFIES: postings
+    void get_postings(uint32_t word, std::vector<std::pair<uint32_t, uint32_t>> &postings) const {
+        postings.clear();
+        for(uint32_t p = word_postings[word]; p < word_postings[word + 1]; p++) {
+            postings.emplace_back(posting_label[p], posting_count[p]);
+        }
+    }
+
+    // RETURNS: log(num posts labeled C / num training posts)
+    double log_prior(uint32_t label) const {
+        return label_log_prior[label];
+    }
+
+    // RETURNS: the log-likelihood of word given label:
+    //          log(C_w_count / label_count) if w occurs with C,
+    //          log(word_count / total_posts) if w only occurs with other labels,
+    //          log(1 / total_posts) if w is Vocabulary::npos
+    double log_likelihood(uint32_t label, uint32_t word) const {
+        if(word == Vocabulary::npos) {
+            return log_unseen;
+        }
+        uint32_t p = find_posting(label, word);
+        return p == UINT32_MAX ? word_log_fallback[word] : posting_log_likelihood[p];
+    }
+
+    // RETURNS: true if some post with this label contained a word
+    bool label_has_words(uint32_t label) const {
+        return label_num_words[label] != 0;
+    }
+
+    // RETURNS: an upper bound on the rounding error of any entry of scores
+    // EFFECTS: sets scores[C] to the log-probability score of a post with the
+    //          given unique words for every label C. A word that does not occur
+    //          with C contributes the same fallback to every label, so the
+    //          fallbacks are summed once into a shared baseline and only the
+    //          postings of the post's words add per-label corrections. The sum
+    //          is grouped differently from calc_log_prob_score, so scores can
+    //          differ from it by up to the returned bound.
+    // MODIFIES: scores
+    double sparse_scores(const std::vector<uint32_t> &word_ids,
+                         std::vector<double> &scores) const {
+        double baseline = 0;
+        double magnitude = 0; // sum of |term| over every term added below
+        size_t terms = 0;
+        for(uint32_t word : word_ids) {
+            double fallback = word == Vocabulary::npos ? log_unseen : word_log_fallback[word];
+            baseline += fallback;
+            magnitude += fabs(fallback);
+        }
+
+        scores.resize(num_labels());
+        double max_prior = 0;
+        for(uint32_t label = 0; label < num_labels(); label++) {
+            scores[label] = label_log_prior[label] + baseline;
+            max_prior = std::max(max_prior, fabs(label_log_prior[label]));
+        }
+        for(uint32_t word : word_ids) {
+            if(word == Vocabulary::npos) {
+                continue;
+            }
+            for(uint32_t p = word_postings[word]; p < word_postings[word + 1]; p++) {
+                scores[posting_label[p]] += posting_delta[p];
+                magnitude += 2 * fabs(posting_delta[p]);
+                terms++;
+            }
+        }
+        magnitude += max_prior;
+        terms += 2 * word_ids.size() + 2;
+        // Each rounding step errs by at most DBL_EPSILON relative to the
+        // running sum, which never exceeds magnitude
+        return 2 * terms * DBL_EPSILON * magnitude;
+    }
+};
+
+#endif
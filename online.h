@@ -0,0 +1,352 @@
+/* The classifier parameters in a form that keeps learning after training:
+the raw counts, plus log tables for sparse scoring that are refreshed for
+just the label and words of each post as it is added or removed, so
+absorbing or forgetting a post costs O(words in the post) instead of a
+rebuild of the Model. Since the model is only counts, removing a post is an
+exact subtraction, and words and labels whose counts reach zero are
+reclaimed for reuse.
+
+The tables hold logs of the counts rather than the log-priors and
+log-likelihoods themselves, since those divide by total_posts and
+label_count, which every post changes. sparse_scores() combines them into
+the same per-label corrections Model precomputes, and the exact
+log-likelihoods used to rescore close candidates are computed from the
+counts, so predictions match a Model built from the same counts. Word and
+label IDs are in order of first appearance; label_by_rank() and
+sorted_word_ids() give the sorted order the Model numbers them in. */
+
+#ifndef ONLINE_H
+#define ONLINE_H
+
+#include <algorithm>
+#include <cfloat>
+#include <cstdint>
+#include <math.h>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "counts.h"
+#include "vocabulary.h"
+
+class OnlineModel {
+    private:
+    struct Posting {
+        uint32_t label;
+        double log_count; // log(C_w_count[label][word])
+    };
+
+    TrainingCounts counts;
+    double log_total = 0; // log(total_posts)
+    std::vector<double> log_label_count; // log(label_count[C])
+    std::vector<double> log_word_count; // log(word_count[w])
+    // word_postings[w]: the labels w occurs with, at most one entry per label
+    std::vector<std::vector<Posting>> word_postings;
+    // posting_slot[C][w]: 1 + the index of C's posting in word_postings[w],
+    // 0 if there is none, so a posting is found by a hashed lookup in C's row
+    // instead of a scan of every label w occurs with
+    std::vector<CountRow> posting_slot;
+    std::vector<uint32_t> label_num_words; // num words seen with each label
+    std::vector<uint32_t> labels_by_name; // label IDs in sorted order
+
+    // RETURNS: the posting of label in word_postings[word], or nullptr
+    Posting *find_posting(uint32_t label, uint32_t word) {
+        uint32_t slot = posting_slot[label][word];
+        return slot == 0 ? nullptr : &word_postings[word][slot - 1];
+    }
+
+    // RETURNS: the posting of label appended to word_postings[word]
+    // MODIFIES: word_postings, posting_slot
+    Posting *add_posting(uint32_t label, uint32_t word, double log_count) {
+        std::vector<Posting> &postings = word_postings[word];
+        postings.push_back({label, log_count});
+        posting_slot[label].set(word, uint32_t(postings.size()));
+        return &postings.back();
+    }
+
+    // RETURNS: -
+    // REQUIRES: label has a posting in word_postings[word]
+    // EFFECTS: removes it, moving the last posting of word into its place
+    // MODIFIES: word_postings, posting_slot
+    void remove_posting(uint32_t label, uint32_t word) {
+        std::vector<Posting> &postings = word_postings[word];
+        uint32_t slot = posting_slot[label][word];
+        postings[slot - 1] = postings.back();
+        posting_slot[postings[slot - 1].label].set(word, slot);
+        postings.pop_back();
+        posting_slot[label].set(word, 0);
+    }
+
+    // RETURNS: -
+    // EFFECTS: adds table entries for IDs new to counts
+    // MODIFIES: log_label_count, label_num_words, posting_slot, log_word_count,
+    //           word_postings
+    void grow_tables() {
+        log_label_count.resize(counts.labels.id_limit(), 0);
+        label_num_words.resize(counts.labels.id_limit(), 0);
+        posting_slot.resize(counts.labels.id_limit());
+        log_word_count.resize(counts.words.id_limit(), 0);
+        word_postings.resize(counts.words.id_limit());
+    }
+
+    // RETURNS: the position of label in labels_by_name, or where it belongs
+    std::vector<uint32_t>::iterator label_rank(uint32_t label) {
+        return std::lower_bound(labels_by_name.begin(), labels_by_name.end(), label,
+            [this](uint32_t a, uint32_t b) {
+                return counts.labels.name(a) < counts.labels.name(b);
+            });
+    }
+
+    public:
+    OnlineModel() = default;
+
+    // EFFECTS: takes over counts and builds every log table from them
+    explicit OnlineModel(TrainingCounts counts_in) : counts(std::move(counts_in)) {
+        grow_tables();
+        labels_by_name = counts.labels.sorted_ids();
+        log_total = log(counts.total_posts);
+        for(uint32_t label : labels_by_name) {
+            log_label_count[label] = log(counts.label_count[label]);
+            counts.C_w_count[label].for_each([&](uint32_t w, uint32_t count) {
+                add_posting(label, w, log(count));
+                label_num_words[label]++;
+            });
+        }
+        for(uint32_t w = 0; w < counts.words.id_limit(); w++) {
+            if(counts.word_count[w] != 0) {
+                log_word_count[w] = log(counts.word_count[w]);
+            }
+        }
+    }
+
+    // RETURNS: the ID of the post's label
+    // EFFECTS: counts one post with the given label and unique words, and
+    //          refreshes the log tables of that label and those words. Sets
+    //          word_ids to the IDs of unique_words.
+    // MODIFIES: counts, the log tables, word_ids
+    uint32_t add_post(std::string_view tag, const std::vector<std::string_view> &unique_words,
+                      std::vector<uint32_t> &word_ids) {
+        uint32_t label = counts.intern_label(tag);
+        grow_tables();
+        if(counts.label_count[label] == 0) {
+            labels_by_name.insert(label_rank(label), label);
+        }
+        counts.label_count[label] += 1;
+        counts.total_posts++;
+        word_ids.clear();
+        for(std::string_view word_str : unique_words) {
+            uint32_t word = counts.intern_word(word_str);
+            word_ids.push_back(word);
+            counts.add_word(label, word, 1);
+            if(word >= word_postings.size()) {
+                grow_tables();
+            }
+            double count = counts.C_w_count[label][word];
+            Posting *posting = find_posting(label, word);
+            if(!posting) {
+                posting = add_posting(label, word, 0);
+                label_num_words[label]++;
+            }
+            posting->log_count = log(count);
+            log_word_count[word] = log(counts.word_count[word]);
+        }
+        log_label_count[label] = log(counts.label_count[label]);
+        log_total = log(counts.total_posts);
+        return label;
+    }
+
+    // RETURNS: false, changing nothing, if no post with this label and these
+    //          words can have been added
+    // REQUIRES: word_ids are unique
+    // EFFECTS: subtracts one post with the given label and words, the
+    //          reverse of add_post, refreshes the log tables of that label
+    //          and those words, and reclaims the label and any word whose
+    //          count reaches zero
+    // MODIFIES: counts, the log tables
+    bool remove_post(uint32_t label, const std::vector<uint32_t> &word_ids) {
+        if(label >= counts.labels.id_limit() || counts.label_count[label] == 0) {
+            return false;
+        }
+        for(uint32_t word : word_ids) {
+            if(word == Vocabulary::npos || get_C_w_count(label, word) == 0) {
+                return false;
+            }
+        }
+
+        for(uint32_t word : word_ids) {
+            counts.add_word(label, word, -1);
+            double count = counts.C_w_count[label][word];
+            if(count == 0) {
+                remove_posting(label, word);
+                label_num_words[label]--;
+            }
+            else {
+                find_posting(label, word)->log_count = log(count);
+            }
+            if(counts.word_count[word] == 0) {
+                counts.reclaim_word(word);
+                log_word_count[word] = 0;
+            }
+            else {
+                log_word_count[word] = log(counts.word_count[word]);
+            }
+        }
+        counts.label_count[label] -= 1;
+        counts.total_posts--;
+        if(counts.label_count[label] == 0) {
+            labels_by_name.erase(label_rank(label));
+            counts.reclaim_label(label);
+            posting_slot[label] = CountRow();
+            log_label_count[label] = 0;
+        }
+        else {
+            log_label_count[label] = log(counts.label_count[label]);
+        }
+        log_total = log(counts.total_posts);
+        return true;
+    }
+
+    // RETURNS: false, changing nothing, if no such post can have been added
+    // EFFECTS: removes a post by its label and unique words, see remove_post
+    // MODIFIES: counts, the log tables, word_ids
+    bool remove_post(std::string_view tag, const std::vector<std::string_view> &unique_words,
+                     std::vector<uint32_t> &word_ids) {
+        word_ids.clear();
+        for(std::string_view word_str : unique_words) {
+            word_ids.push_back(counts.words.find(word_str));
+        }
+        uint32_t label = counts.labels.find(tag);
+        return label != Vocabulary::npos && remove_post(label, word_ids);
+    }
+
+    // RETURNS: the counts the model has absorbed, e.g. to freeze into a Model
+    const TrainingCounts &get_counts() const {
+        return counts;
+    }
+
+    double get_total_posts() const {
+        return counts.total_posts;
+    }
+
+    // RETURNS: the number of labels with posts, which may be fewer than the
+    //          label IDs in use for scores, since IDs are reused
+    size_t num_labels() const {
+        return counts.labels.size();
+    }
+
+    size_t vocab_size() const {
+        return counts.words.size();
+    }
+
+    // RETURNS: the ID of the label that sorts rank-th by name
+    uint32_t label_by_rank(uint32_t rank) const {
+        return labels_by_name[rank];
+    }
+
+    // RETURNS: every word ID, in sorted order of the words
+    std::vector<uint32_t> sorted_word_ids() const {
+        return counts.words.sorted_ids();
+    }
+
+    // RETURNS: the ID of label, or Vocabulary::npos if it has no posts
+    uint32_t find_label(std::string_view label) const {
+        return counts.labels.find(label);
+    }
+
+    // RETURNS: the ID of word, or Vocabulary::npos if it has not occurred
+    uint32_t find_word(std::string_view word) const {
+        return counts.words.find(word);
+    }
+
+    std::string_view label_name(uint32_t label) const {
+        return counts.labels.name(label);
+    }
+
+    std::string_view word_name(uint32_t word) const {
+        return counts.words.name(word);
+    }
+
+    double get_label_count(uint32_t label) const {
+        return counts.label_count[label];
+    }
+
+    // RETURNS: num posts with label C that contain w (0 if w is Vocabulary::npos)
+    double get_C_w_count(uint32_t label, uint32_t word) const {
+        return counts.C_w_count[label][word];
+    }
+
+    // RETURNS: -
+    // EFFECTS: sets postings to the (label ID, C_w_count) pairs of word
+    // MODIFIES: postings
+    void get_postings(uint32_t word, std::vector<std::pair<uint32_t, uint32_t>> &postings) const {
+        postings.clear();
+        for(const Posting &posting : word_postings[word]) {
+            postings.emplace_back(posting.label, counts.C_w_count[posting.label][word]);
+        }
+    }
+
+    // RETURNS: log(num posts labeled C / num posts)
+    double log_prior(uint32_t label) const {
+        return log(double(counts.label_count[label]) / counts.total_posts);
+    }
+
+    // RETURNS: the log-likelihood of word given label, as in Model
+    double log_likelihood(uint32_t label, uint32_t word) const {
+        if(word == Vocabulary::npos) {
+            return log(1 / double(counts.total_posts));
+        }
+        double count = get_C_w_count(label, word);
+        if(count == 0) {
+            return log(double(counts.word_count[word]) / counts.total_posts);
+        }
+        return log(count / counts.label_count[label]);
+    }
+
+    // RETURNS: true if some post with this label contained a word
+    bool label_has_words(uint32_t label) const {
+        return label_num_words[label] != 0;
+    }
+
+    // RETURNS: an upper bound on the rounding error of any entry of scores
+    // EFFECTS: sets scores[C] to the log-probability score of a post with the
+    //          given unique words for every label C, like Model::sparse_scores,
+    //          with each fallback and correction formed from the log counts
+    // MODIFIES: scores
+    double sparse_scores(const std::vector<uint32_t> &word_ids,
+                         std::vector<double> &scores) const {
+        double baseline = 0;
+        double magnitude = 0; // sum of |value| over every log and partial sum
+        size_t terms = 0;
+        for(uint32_t word : word_ids) {
+            double log_count = word == Vocabulary::npos ? 0 : log_word_count[word];
+            baseline += log_count - log_total;
+            magnitude += log_count + log_total + fabs(baseline);
+        }
+
+        scores.resize(log_label_count.size());
+        double max_prior = 0;
+        for(uint32_t label : labels_by_name) {
+            scores[label] = log_label_count[label] - log_total + baseline;
+            max_prior = std::max(max_prior, log_label_count[label] + log_total);
+        }
+        for(uint32_t word : word_ids) {
+            if(word == Vocabulary::npos) {
+                continue;
+            }
+            double fallback = log_word_count[word] - log_total;
+            for(const Posting &posting : word_postings[word]) {
+                double delta = posting.log_count - log_label_count[posting.label] - fallback;
+                scores[posting.label] += delta;
+                magnitude += posting.log_count + log_label_count[posting.label] +
+                    log_word_count[word] + log_total + 2 * fabs(delta);
+                terms += 4;
+            }
+        }
+        magnitude += max_prior + fabs(baseline);
+        terms += 3 * word_ids.size() + 3;
+        // Each log is within an ulp of its value and each rounding step errs
+        // by at most DBL_EPSILON relative to a value no larger than magnitude
+        return 2 * terms * DBL_EPSILON * (magnitude + terms);
+    }
+};
+
+#endif
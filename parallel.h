@@ -0,0 +1,353 @@
+/* A small fixed-size thread pool for splitting independent work items
+(posts, chunks) across threads, and a bounded lock-free queue for passing
+work between the stages of a pipeline. Threads waiting on the queue spin
+briefly, then sleep until it changes, so a stage stalled on slow input
+(a pipe, a decompressor) costs no CPU. */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+    private:
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable work_ready; // a new batch was posted, or stopping
+    std::condition_variable work_done; // a worker finished its part of a batch
+    const std::function<void(size_t, size_t)> *task = nullptr;
+    size_t num_items = 0;
+    std::atomic<size_t> next_item{0};
+    size_t generation = 0; // incremented for every batch
+    size_t num_busy = 0; // workers still running the current batch
+    bool stopping = false;
+    std::exception_ptr error; // first exception thrown by the current batch
+
+    // RETURNS: -
+    // EFFECTS: claims items of the current batch until none are left
+    // MODIFIES: next_item, error
+    void run_items(size_t worker) {
+        size_t i;
+        while((i = next_item.fetch_add(1)) < num_items) {
+            try {
+                (*task)(worker, i);
+            }
+            catch(...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    void worker_loop(size_t worker) {
+        size_t seen = 0;
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                work_ready.wait(lock, [&]() { return stopping || generation != seen; });
+                if(stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            run_items(worker);
+            std::lock_guard<std::mutex> lock(mutex);
+            if(--num_busy == 0) {
+                work_done.notify_one();
+            }
+        }
+    }
+
+    public:
+    // EFFECTS: starts num_threads - 1 workers; the calling thread is the last
+    explicit ThreadPool(size_t num_threads) {
+        for(size_t worker = 1; worker < num_threads; worker++) {
+            workers.emplace_back(&ThreadPool::worker_loop, this, worker);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        work_ready.notify_all();
+        for(std::thread &worker : workers) {
+            worker.join();
+        }
+    }
+
+    // RETURNS: the number of threads work is spread over, including the caller
+    size_t size() const {
+        return workers.size() + 1;
+    }
+
+    // RETURNS: -
+    // EFFECTS: calls fn(worker, i) for every i in [0, n), spread over the
+    //          pool's threads. worker is in [0, size()) and no two calls with
+    //          the same worker run at once, so it can index per-thread scratch.
+    //          Returns when every call is done, rethrowing the first exception.
+    // MODIFIES: -
+    void parallel_for(size_t n, const std::function<void(size_t, size_t)> &fn) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            task = &fn;
+            num_items = n;
+            next_item = 0;
+            num_busy = workers.size();
+            error = nullptr;
+            generation++;
+        }
+        work_ready.notify_all();
+        run_items(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        work_done.wait(lock, [&]() { return num_busy == 0; });
+        if(error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+// An event count that threads sleep on until another thread signals a
+// change: a waiter calls prepare(), rechecks its condition, then wait()s or
+// cancel()s. Signalling only makes a system call if someone is waiting.
+// Uses C++20 atomic wait/notify, or a mutex and condition variable before.
+class Signal {
+    private:
+    std::atomic<uint32_t> epoch{0}; // bumped by every signal with waiters
+    std::atomic<uint32_t> waiters{0};
+#ifndef __cpp_lib_atomic_wait
+    std::mutex mutex;
+    std::condition_variable changed;
+#endif
+
+    void bump() {
+        epoch.fetch_add(1);
+#ifdef __cpp_lib_atomic_wait
+        epoch.notify_all();
+#else
+        // Taking the lock orders the bump before or after a waiter's check
+        { std::lock_guard<std::mutex> lock(mutex); }
+        changed.notify_all();
+#endif
+    }
+
+    public:
+    // RETURNS: the epoch to pass to wait()
+    // EFFECTS: registers a waiter, which must recheck its condition after
+    //          this and then call wait() or cancel()
+    uint32_t prepare() {
+        // Read-modify-writes of waiters are totally ordered, so either
+        // notify() sees this waiter, or the waiter's recheck sees the change
+        // made before notify()
+        waiters.fetch_add(1);
+        return epoch.load();
+    }
+
+    // RETURNS: -
+    // EFFECTS: unregisters a waiter whose condition held after all
+    void cancel() {
+        waiters.fetch_sub(1);
+    }
+
+    // RETURNS: -
+    // EFFECTS: sleeps until the epoch moves on from seen, then unregisters
+    void wait(uint32_t seen) {
+#ifdef __cpp_lib_atomic_wait
+        epoch.wait(seen);
+#else
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() { return epoch.load() != seen; });
+#endif
+        waiters.fetch_sub(1);
+    }
+
+    // RETURNS: -
+    // EFFECTS: wakes the waiters, if any, after a change they wait for
+    void notify() {
+        if(waiters.fetch_add(0) != 0) {
+            bump();
+        }
+    }
+
+    // RETURNS: -
+    // EFFECTS: wakes every waiter, for a change that also ends waiting
+    void notify_all() {
+        bump();
+    }
+};
+
+// A bounded multi-producer/multi-consumer ring buffer (Vyukov's design):
+// each cell carries a sequence number that tells producers and consumers
+// whether it is free or full for their lap around the ring, so push and pop
+// only contend on one atomic counter each and never take a lock. A push or
+// pop that has to wait spins for a while, then sleeps on a Signal. Once
+// closed, pops drain what is left and pushes fail.
+template <typename T>
+class BoundedQueue {
+    private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    std::unique_ptr<Cell[]> cells;
+    size_t mask; // capacity - 1, with capacity a power of two
+    alignas(64) std::atomic<size_t> push_pos{0};
+    alignas(64) std::atomic<size_t> pop_pos{0};
+    alignas(64) std::atomic<bool> closed{false};
+    Signal not_empty; // signalled after a push, for waiting pops
+    Signal not_full; // signalled after a pop, for waiting pushes
+
+    // Tries before a waiting push or pop sleeps, yielding between them
+    static constexpr int spin_tries = 64;
+
+    public:
+    // EFFECTS: makes an empty queue holding at least capacity items
+    explicit BoundedQueue(size_t capacity) {
+        size_t size = 2;
+        while(size < capacity) {
+            size *= 2;
+        }
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for(size_t i = 0; i < size; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+    // RETURNS: false if the queue is full
+    // MODIFIES: the queue
+    bool try_push(const T &value) {
+        size_t pos = push_pos.load(std::memory_order_relaxed);
+        while(true) {
+            Cell &cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t lag = std::ptrdiff_t(sequence - pos);
+            if(lag == 0) {
+                if(push_pos.compare_exchange_weak(pos, pos + 1,
+                                                  std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(lag < 0) {
+                return false; // the cell still holds last lap's item
+            }
+            else {
+                pos = push_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // RETURNS: false if the queue is empty
+    // MODIFIES: value, the queue
+    bool try_pop(T &value) {
+        size_t pos = pop_pos.load(std::memory_order_relaxed);
+        while(true) {
+            Cell &cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t lag = std::ptrdiff_t(sequence - (pos + 1));
+            if(lag == 0) {
+                if(pop_pos.compare_exchange_weak(pos, pos + 1,
+                                                 std::memory_order_relaxed)) {
+                    value = cell.value;
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if(lag < 0) {
+                return false; // nothing pushed into the cell yet
+            }
+            else {
+                pos = pop_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // RETURNS: false if the queue was closed before value fit
+    // EFFECTS: waits while the queue is full
+    // MODIFIES: the queue
+    bool push(const T &value) {
+        for(int tries = 0; !try_push(value); ) {
+            if(closed.load(std::memory_order_acquire)) {
+                return false;
+            }
+            if(tries < spin_tries) {
+                tries++;
+                std::this_thread::yield();
+                continue;
+            }
+            uint32_t seen = not_full.prepare();
+            if(try_push(value)) {
+                not_full.cancel();
+                break;
+            }
+            if(closed.load(std::memory_order_acquire)) {
+                not_full.cancel();
+                return false;
+            }
+            not_full.wait(seen);
+        }
+        not_empty.notify();
+        return true;
+    }
+
+    // RETURNS: false if the queue is closed and empty
+    // EFFECTS: waits while the queue is empty but open
+    // MODIFIES: value, the queue
+    bool pop(T &value) {
+        for(int tries = 0; !try_pop(value); ) {
+            if(closed.load(std::memory_order_acquire)) {
+                // Items pushed before close() are visible now
+                if(!try_pop(value)) {
+                    return false;
+                }
+                break;
+            }
+            if(tries < spin_tries) {
+                tries++;
+                std::this_thread::yield();
+                continue;
+            }
+            uint32_t seen = not_empty.prepare();
+            if(try_pop(value)) {
+                not_empty.cancel();
+                break;
+            }
+            if(closed.load(std::memory_order_acquire)) {
+                not_empty.cancel();
+                continue;
+            }
+            not_empty.wait(seen);
+        }
+        not_full.notify();
+        return true;
+    }
+
+    // RETURNS: -
+    // EFFECTS: wakes every waiting push and pop: pops drain what is left,
+    //          and pushes that would have to wait fail
+    // MODIFIES: closed
+    void close() {
+        closed.store(true, std::memory_order_release);
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
+
+#endif
@@ -0,0 +1,176 @@
+/* Training counts that drop rare words as they go, for --min-df. Words are
+tracked by lossy counting: the posts are split into buckets of
+bucket_posts, a word first seen in bucket b may already have been missed
+b - 1 times, and at the end of each bucket every word whose count plus that
+allowance does not exceed the bucket number is dropped, with all of its
+per-label counts. Words seen once are gone at the end of their bucket, so
+the tables hold O(bucket_posts * log(posts / bucket_posts)) words however
+long the input is, and a kept word's counts fall short by at most one per
+bucket it was not tracked in. When all posts fit in one bucket nothing is
+dropped early and the counts of the kept words are exact.
+
+At the end, words in fewer than min_df posts are dropped too, so the model
+only keeps words it counted in at least min_df posts. Dropped words score
+like words never seen in training, and their posts still count toward
+total_posts and their labels. */
+
+#ifndef PRUNE_H
+#define PRUNE_H
+
+#include <algorithm>
+#include <bitset>
+#include <cstdint>
+#include <math.h>
+#include <string_view>
+#include <vector>
+#include "counts.h"
+#include "model.h"
+#include "sketch.h"
+
+// How much --min-df pruning shrank the vocabulary and the model
+struct PruneStats {
+    double words_seen = 0; // estimated distinct words in the training data
+    size_t words_kept = 0;
+    size_t postings_kept = 0; // nonzero (label, word) counts in the model
+    size_t postings_dropped = 0; // nonzero (label, word) counts dropped
+};
+
+class PruningCounts {
+    private:
+    TrainingCounts counts;
+    uint32_t min_df;
+    size_t bucket_posts;
+    uint32_t bucket = 1; // the number of the current bucket
+    size_t posts_in_bucket = 0;
+    // word_allowance[w]: how many posts with w may have been missed before
+    // w was tracked, the bucket number it was first seen in minus one
+    std::vector<uint32_t> word_allowance;
+    // One bit per hash bucket of the words seen, for estimating their
+    // number by linear counting
+    std::vector<uint64_t> seen_bits;
+    PruneStats stats;
+
+    // Scratch for drop_words, kept so dropping allocates nothing
+    std::vector<uint32_t> dropped; // the word IDs to drop
+    std::vector<bool> is_dropped; // is_dropped[w]: w is in dropped
+    std::vector<uint32_t> row_dropped; // the dropped words found in one row
+
+    // RETURNS: -
+    // EFFECTS: drops the words in dropped and their per-label counts, and
+    //          frees their IDs. Each row is walked if it has fewer counts
+    //          than there are words to drop, and probed for each word if
+    //          not, so the cost is bounded by the counts in the tables and
+    //          does not grow with dropped words times labels.
+    // MODIFIES: counts, stats, dropped
+    void drop_words() {
+        if(dropped.empty()) {
+            return;
+        }
+        is_dropped.assign(counts.words.id_limit(), false);
+        for(uint32_t word : dropped) {
+            is_dropped[word] = true;
+        }
+        for(uint32_t label = 0; label < counts.labels.id_limit(); label++) {
+            CountRow &row = counts.C_w_count[label];
+            row_dropped.clear();
+            if(row.num_counts() < dropped.size()) {
+                row.for_each([this](uint32_t word, uint32_t) {
+                    if(is_dropped[word]) {
+                        row_dropped.push_back(word);
+                    }
+                });
+            }
+            else {
+                for(uint32_t word : dropped) {
+                    if(row[word] != 0) {
+                        row_dropped.push_back(word);
+                    }
+                }
+            }
+            for(uint32_t word : row_dropped) {
+                counts.add_word(label, word, -int64_t(row[word]));
+            }
+            stats.postings_dropped += row_dropped.size();
+        }
+        for(uint32_t word : dropped) {
+            counts.reclaim_word(word);
+        }
+        dropped.clear();
+    }
+
+    // RETURNS: -
+    // EFFECTS: ends the current bucket, dropping the words whose count plus
+    //          allowance does not exceed its number
+    // MODIFIES: counts, bucket, posts_in_bucket, stats
+    void end_bucket() {
+        // With min_df 1 every word is kept, so none may be dropped early
+        for(uint32_t word = 0; min_df > 1 && word < counts.words.id_limit(); word++) {
+            if(counts.word_count[word] != 0 &&
+               counts.word_count[word] + word_allowance[word] <= bucket) {
+                dropped.push_back(word);
+            }
+        }
+        drop_words();
+        bucket++;
+        posts_in_bucket = 0;
+    }
+
+    public:
+    // EFFECTS: keeps words in at least min_df posts, tracking them by lossy
+    //          counting over buckets of bucket_posts posts
+    PruningCounts(uint32_t min_df_in, size_t bucket_posts_in)
+        : min_df(min_df_in), bucket_posts(bucket_posts_in), seen_bits(1 << 14, 0) {}
+
+    // RETURNS: -
+    // EFFECTS: counts one post, dropping rare words at the end of a bucket
+    // MODIFIES: counts, word_allowance, seen_bits, bucket, stats
+    void add_post(std::string_view tag, const std::vector<std::string_view> &unique_words) {
+        uint32_t label = counts.intern_label(tag);
+        counts.label_count[label] += 1;
+        for(std::string_view word_str : unique_words) {
+            uint32_t word = counts.intern_word(word_str);
+            if(counts.word_count[word] == 0) {
+                word_allowance.resize(counts.words.id_limit(), 0);
+                word_allowance[word] = bucket - 1;
+            }
+            counts.add_word(label, word, 1);
+            uint32_t bit = uint32_t(sketch_hash(word_str)) % (seen_bits.size() * 64);
+            seen_bits[bit / 64] |= uint64_t(1) << (bit % 64);
+        }
+        counts.total_posts++;
+        if(++posts_in_bucket == bucket_posts) {
+            end_bucket();
+        }
+    }
+
+    // RETURNS: how much pruning shrank the vocabulary and the model
+    // EFFECTS: drops the words counted in fewer than min_df posts and
+    //          replaces model with the model of the rest
+    // MODIFIES: counts, model, stats
+    PruneStats finish(Model &model) {
+        for(uint32_t word = 0; word < counts.words.id_limit(); word++) {
+            if(counts.word_count[word] != 0 && counts.word_count[word] < min_df) {
+                dropped.push_back(word);
+            }
+        }
+        drop_words();
+        size_t zeros = 0;
+        for(uint64_t bits : seen_bits) {
+            zeros += 64 - std::bitset<64>(bits).count();
+        }
+        double num_bits = double(seen_bits.size() * 64);
+        stats.words_kept = counts.words.size();
+        // The estimate can fall short of the words actually kept
+        stats.words_seen = std::max(-num_bits * log(std::max(zeros, size_t(1)) / num_bits),
+                                    double(stats.words_kept));
+        for(const CountRow &row : counts.C_w_count) {
+            stats.postings_kept += row.num_counts();
+        }
+
+        model = Model(counts);
+        counts = TrainingCounts();
+        return stats;
+    }
+};
+
+#endif
@@ -0,0 +1,84 @@
+/* Helpers for the tests and benchmarks that run main.exe's code in-process:
+main.cpp built with main renamed to classifier_main (classifier_main.o in
+the Makefile), fed CSV files they write to the temp directory. */
+
+#ifndef RUN_CLASSIFIER_H
+#define RUN_CLASSIFIER_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+int classifier_main(int argc, char *argv[]);
+
+// RETURNS: the directory for temporary files: $TMPDIR, or /tmp
+inline std::string temp_dir() {
+    const char *tmpdir = getenv("TMPDIR");
+    return tmpdir ? tmpdir : "/tmp";
+}
+
+// RETURNS: -
+// EFFECTS: writes a CSV with the classifier's columns and num_rows rows,
+//          calling write_post(out, row) to write the tag and content of
+//          each as "TAG,CONTENT"
+// MODIFIES: the file at path
+template<typename WritePost>
+void write_posts(const std::string &path, size_t num_rows, WritePost write_post) {
+    std::ofstream out(path);
+    out << "n,unique_views,tag,content\n";
+    for(size_t row = 0; row < num_rows; row++) {
+        out << row << ",1,";
+        write_post(out, row);
+        out << "\n";
+    }
+}
+
+// RETURNS: the contents of the file at path
+inline std::string read_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// RETURNS: the exit status of classifier_main run with args, args[0] being
+//          the program name
+// EFFECTS: discards its standard output, and writes its standard error to
+//          stderr_file if one is given
+// MODIFIES: args
+inline int run_classifier(std::vector<std::string> &args, const std::string &stderr_file = "") {
+    std::vector<char *> argv;
+    argv.reserve(args.size() + 1);
+    for(std::string &arg : args) {
+        argv.push_back(&arg[0]);
+    }
+    argv.push_back(nullptr);
+
+    std::cout.flush();
+    std::cerr.flush();
+    int saved_stdout = dup(1);
+    int saved_stderr = dup(2);
+    int null = open("/dev/null", O_WRONLY);
+    int err = stderr_file.empty() ? -1 : open(stderr_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    dup2(null, 1);
+    if(err >= 0) {
+        dup2(err, 2);
+    }
+    int status = classifier_main(int(args.size()), argv.data());
+    std::cout.flush();
+    std::cerr.flush();
+    dup2(saved_stdout, 1);
+    dup2(saved_stderr, 2);
+    close(null);
+    if(err >= 0) {
+        close(err);
+    }
+    close(saved_stdout);
+    close(saved_stderr);
+    return status;
+}
+
+#endif
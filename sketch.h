@@ -0,0 +1,245 @@
+/* An approximate model whose memory does not grow with the vocabulary. The
+per-word and per-(label, word) document counts live in Count-Min sketches:
+depth rows of width counters each, where a word adds to one counter per
+row, picked by its own hash for that row, and its count is read back as the
+smallest of its counters. Collisions can only add, so estimates never fall
+short of the true count and are usually exact for frequent words. Counters
+are only raised as far as the new estimate needs (conservative update),
+which keeps the overestimates of rare words small.
+
+No word strings are stored, so the debug dump of every parameter is not
+available, and a word counts as unseen only if all of its counters are
+still zero. Labels, their counts and total_posts are exact. With depth 1
+each table is a plain array of 2^k buckets, which is the hashing trick.
+
+The per-label sketches share one table, with the counters of every label
+for a bucket side by side, so scoring a word against all labels reads
+depth short runs of memory instead of depth counters per label. */
+
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <math.h>
+#include <string_view>
+#include <vector>
+#include "vocabulary.h"
+
+// RETURNS: a 64-bit hash of word, the same one Vocabulary uses
+inline uint64_t sketch_hash(std::string_view word) {
+    return string_hash(word);
+}
+
+class CountMinSketch {
+    private:
+    uint32_t width;
+    uint32_t depth;
+    std::vector<uint32_t> counters; // depth rows of width
+
+    public:
+    CountMinSketch(uint32_t width_in, uint32_t depth_in)
+        : width(width_in), depth(depth_in), counters(size_t(width_in) * depth_in, 0) {}
+
+    // RETURNS: -
+    // EFFECTS: sets buckets[row] to the counter of hash in each row, from two
+    //          halves of hash (double hashing), so a word is hashed once
+    //          however many rows and labels it is looked up in
+    // MODIFIES: buckets
+    static void find_buckets(uint64_t hash, uint32_t width, uint32_t depth,
+                             std::vector<uint32_t> &buckets) {
+        buckets.resize(depth);
+        uint32_t h1 = uint32_t(hash);
+        uint32_t h2 = uint32_t(hash >> 32) | 1;
+        for(uint32_t row = 0; row < depth; row++) {
+            uint32_t mixed = h1 + row * h2;
+            buckets[row] = row * width + uint32_t((uint64_t(mixed) * width) >> 32);
+        }
+    }
+
+    // RETURNS: the estimated count of the item in buckets
+    uint32_t estimate(const std::vector<uint32_t> &buckets) const {
+        uint32_t count = UINT32_MAX;
+        for(uint32_t bucket : buckets) {
+            count = std::min(count, counters[bucket]);
+        }
+        return count;
+    }
+
+    // RETURNS: -
+    // EFFECTS: adds one to the item in buckets, raising only the counters
+    //          below the new estimate
+    // MODIFIES: counters
+    void add(const std::vector<uint32_t> &buckets) {
+        uint32_t count = estimate(buckets) + 1;
+        for(uint32_t bucket : buckets) {
+            counters[bucket] = std::max(counters[bucket], count);
+        }
+    }
+
+    // RETURNS: the fraction of row 0's counters that are still zero
+    double zero_fraction() const {
+        size_t zeros = std::count(counters.begin(), counters.begin() + width, 0u);
+        return double(zeros) / width;
+    }
+
+    size_t memory_bytes() const {
+        return counters.size() * sizeof(uint32_t);
+    }
+};
+
+class SketchModel {
+    private:
+    uint32_t width = 0;
+    uint32_t depth = 0;
+    uint64_t total_posts = 0;
+    Vocabulary labels;
+    std::vector<uint32_t> label_count;
+    std::vector<uint32_t> label_num_words;
+    std::vector<uint32_t> labels_by_name; // label IDs in sorted order
+    CountMinSketch word_counts{1, 1}; // posts containing each word
+    // C_w_counts[bucket * label_stride + label]: the per-label sketches of
+    // posts containing each word, with room for label_stride labels
+    std::vector<uint32_t> C_w_counts;
+    uint32_t label_stride = 0;
+    std::vector<uint32_t> buckets; // scratch for add_post
+
+    // RETURNS: -
+    // EFFECTS: makes room in C_w_counts for one more label, doubling
+    //          label_stride when it is full so relayouts stay rare
+    // MODIFIES: C_w_counts, label_stride
+    void grow_labels() {
+        if(label_count.size() <= label_stride) {
+            return;
+        }
+        uint32_t stride = std::max(1u, label_stride * 2);
+        std::vector<uint32_t> grown(size_t(width) * depth * stride, 0);
+        for(size_t bucket = 0; bucket < size_t(width) * depth; bucket++) {
+            // data() + offset, since C_w_counts is empty on the first label
+            std::copy_n(C_w_counts.data() + bucket * label_stride, label_stride,
+                        grown.data() + bucket * stride);
+        }
+        C_w_counts.swap(grown);
+        label_stride = stride;
+    }
+
+    // RETURNS: the estimated num posts with label that contain the word in
+    //          buckets
+    uint32_t C_w_estimate(uint32_t label, const std::vector<uint32_t> &word_buckets) const {
+        uint32_t count = UINT32_MAX;
+        for(uint32_t bucket : word_buckets) {
+            count = std::min(count, C_w_counts[size_t(bucket) * label_stride + label]);
+        }
+        return count;
+    }
+
+    public:
+    SketchModel() = default;
+
+    // EFFECTS: makes an empty model with sketches of depth rows of width
+    SketchModel(uint32_t width_in, uint32_t depth_in)
+        : width(width_in), depth(depth_in), word_counts(width_in, depth_in) {}
+
+    // RETURNS: -
+    // EFFECTS: counts one post with the given label and unique words
+    // MODIFIES: the counts and sketches
+    void add_post(std::string_view tag, const std::vector<std::string_view> &unique_words) {
+        uint32_t label = labels.intern(tag);
+        if(label == label_count.size()) {
+            label_count.push_back(0);
+            label_num_words.push_back(0);
+            grow_labels();
+            labels_by_name = labels.sorted_ids();
+        }
+        label_count[label] += 1;
+        total_posts++;
+        for(std::string_view word : unique_words) {
+            CountMinSketch::find_buckets(sketch_hash(word), width, depth, buckets);
+            word_counts.add(buckets);
+            // Conservative update, as in CountMinSketch::add
+            uint32_t count = C_w_estimate(label, buckets);
+            for(uint32_t bucket : buckets) {
+                uint32_t &counter = C_w_counts[size_t(bucket) * label_stride + label];
+                counter = std::max(counter, count + 1);
+            }
+        }
+        label_num_words[label] += !unique_words.empty();
+    }
+
+    double get_total_posts() const {
+        return total_posts;
+    }
+
+    size_t num_labels() const {
+        return labels.size();
+    }
+
+    // RETURNS: the ID of the label that sorts rank-th by name
+    uint32_t label_by_rank(uint32_t rank) const {
+        return labels_by_name[rank];
+    }
+
+    std::string_view label_name(uint32_t label) const {
+        return labels.name(label);
+    }
+
+    double get_label_count(uint32_t label) const {
+        return label_count[label];
+    }
+
+    // RETURNS: true if some post with this label contained a word
+    bool label_has_words(uint32_t label) const {
+        return label_num_words[label] != 0;
+    }
+
+    // RETURNS: log(num posts labeled C / num posts)
+    double log_prior(uint32_t label) const {
+        return log(double(label_count[label]) / total_posts);
+    }
+
+    // RETURNS: the number of distinct words seen, estimated from how many
+    //          counters of the first row are still zero (linear counting)
+    double estimate_vocab_size() const {
+        double zeros = word_counts.zero_fraction();
+        if(zeros == 0) {
+            return width; // saturated; the estimate is only a lower bound
+        }
+        return -double(width) * log(zeros);
+    }
+
+    // RETURNS: the bytes held by the sketches
+    size_t memory_bytes() const {
+        return word_counts.memory_bytes() + C_w_counts.size() * sizeof(uint32_t);
+    }
+
+    // RETURNS: -
+    // EFFECTS: sets scores[C] to the log-probability score of a post with the
+    //          given unique words for every label C, from the estimated
+    //          counts, adding the terms in the order calc_log_prob_score does
+    // MODIFIES: scores, post_buckets
+    void scores(const std::vector<std::string_view> &unique_words, std::vector<double> &scores,
+                std::vector<uint32_t> &post_buckets) const {
+        scores.resize(num_labels());
+        for(uint32_t label = 0; label < num_labels(); label++) {
+            scores[label] = log_prior(label);
+        }
+        for(std::string_view word : unique_words) {
+            CountMinSketch::find_buckets(sketch_hash(word), width, depth, post_buckets);
+            double count = word_counts.estimate(post_buckets);
+            for(uint32_t label = 0; label < num_labels(); label++) {
+                double C_w_count = C_w_estimate(label, post_buckets);
+                if(count == 0) {
+                    scores[label] += log(1 / double(total_posts));
+                }
+                else if(C_w_count == 0) {
+                    scores[label] += log(count / total_posts);
+                }
+                else {
+                    scores[label] += log(C_w_count / label_count[label]);
+                }
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,36 @@
+/* Checks that the sketch model's per-label table holds exactly as many
+labels as it must at each power of two, so --sketch uses the memory its
+width and depth promise and --compare reports it. Build and run with
+make test. */
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "sketch.h"
+
+using namespace std;
+
+const uint32_t WIDTH = 100;
+const uint32_t DEPTH = 3;
+
+int main() {
+    SketchModel model(WIDTH, DEPTH);
+    vector<string_view> words = {"a", "b"};
+    bool ok = true;
+    for(size_t num_labels = 1; num_labels <= 256; num_labels++) {
+        string tag = "label" + to_string(num_labels - 1);
+        model.add_post(tag, words);
+        if((num_labels & (num_labels - 1)) != 0) {
+            continue;
+        }
+        // The word sketch, plus one counter per label in each bucket
+        size_t expected = size_t(WIDTH) * DEPTH * (1 + num_labels) * sizeof(uint32_t);
+        bool right = model.memory_bytes() == expected;
+        ok = ok && right;
+        cout << num_labels << " labels: " << model.memory_bytes() << " bytes"
+            << (right ? "" : " -- FAILED, expected " + to_string(expected)) << endl;
+    }
+    cout << (ok ? "PASS" : "FAIL") << endl;
+    return ok ? 0 : 1;
+}
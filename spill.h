@@ -0,0 +1,524 @@
+/* Training counts on disk, for training on more posts than fit in memory.
+A run file holds the counts of some of the training posts, sorted by word:
+    RunHeader
+    label table         per label: u32 name length, name, u32 label_count
+    words               per word, in sorted order: u32 name length, name,
+                        u32 num postings, then per posting: u32 label ID
+                        (an index into the label table), u32 C_w_count
+Numbers are in native byte order. The header's totals are filled in when
+the writer closes, so a run can be streamed out without knowing them first.
+
+Counts that outgrow their memory budget are spilled as runs, and the runs
+are combined by a k-way merge that streams every word's postings once, in
+sorted order, which is the order a Model is laid out in. SpillingCounts
+ties these together for training under a memory budget.
+
+Runs are also the shard format of --emit-counts: the counts of separately
+trained parts of the data, which merge_counts combines into the model of
+all of them. */
+
+#ifndef SPILL_H
+#define SPILL_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+#include "counts.h"
+#include "model.h"
+#include "vocabulary.h"
+
+struct RunHeader {
+    char magic[8]; // "PZRUN002"
+    uint32_t byte_order; // 0x01020304 as written by the writing machine
+    uint32_t num_labels;
+    uint64_t total_posts;
+    uint64_t num_words;
+    uint64_t num_postings;
+    uint64_t word_bytes; // total length of the words
+};
+
+// (label ID, C_w_count) pairs of one word
+typedef std::vector<std::pair<uint32_t, uint32_t>> RunPostings;
+
+class RunWriter {
+    private:
+    FILE *file = nullptr;
+    RunHeader header;
+    bool ok = false;
+
+    void write(const void *bytes, size_t size) {
+        ok = ok && fwrite(bytes, 1, size, file) == size;
+    }
+
+    void write_string(std::string_view str) {
+        uint32_t size = uint32_t(str.size());
+        write(&size, sizeof(size));
+        write(str.data(), size);
+    }
+
+    public:
+    // REQUIRES: labels has no erased IDs
+    // EFFECTS: creates path and writes the header and label table. Label IDs
+    //          in add() index labels.
+    RunWriter(const std::string &path, const Vocabulary &labels,
+              const std::vector<uint32_t> &label_count, uint64_t total_posts) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "PZRUN002", 8);
+        header.byte_order = 0x01020304;
+        header.num_labels = uint32_t(labels.id_limit());
+        header.total_posts = total_posts;
+        file = fopen(path.c_str(), "wb");
+        ok = file != nullptr;
+        if(!ok) {
+            return;
+        }
+        write(&header, sizeof(header));
+        for(uint32_t label = 0; label < labels.id_limit(); label++) {
+            write_string(labels.name(label));
+            write(&label_count[label], sizeof(uint32_t));
+        }
+    }
+
+    RunWriter(const RunWriter &) = delete;
+    RunWriter &operator=(const RunWriter &) = delete;
+
+    ~RunWriter() {
+        close();
+    }
+
+    // RETURNS: -
+    // REQUIRES: word sorts after every word added before
+    // EFFECTS: appends word and its postings
+    // MODIFIES: the file
+    void add(std::string_view word, const RunPostings &postings) {
+        if(!ok) {
+            return;
+        }
+        write_string(word);
+        uint32_t size = uint32_t(postings.size());
+        write(&size, sizeof(size));
+        for(const std::pair<uint32_t, uint32_t> &posting : postings) {
+            write(&posting.first, sizeof(uint32_t));
+            write(&posting.second, sizeof(uint32_t));
+        }
+        header.num_words++;
+        header.num_postings += postings.size();
+        header.word_bytes += word.size();
+    }
+
+    // RETURNS: true if the whole run was written
+    // EFFECTS: fills in the header's totals and closes the file
+    // MODIFIES: the file
+    bool close() {
+        if(file) {
+            ok = ok && fseek(file, 0, SEEK_SET) == 0;
+            write(&header, sizeof(header));
+            ok = fclose(file) == 0 && ok;
+            file = nullptr;
+        }
+        return ok;
+    }
+};
+
+// Reads a run without trusting it: runs may come from other machines, so
+// every length is checked against the header's totals before it is used,
+// and a run whose words are not in strictly increasing order, or whose
+// totals do not add up, is not good()
+class RunReader {
+    private:
+    FILE *file = nullptr;
+    RunHeader header;
+    uint64_t file_size = 0;
+    uint64_t words_read = 0;
+    uint64_t postings_read = 0;
+    uint64_t word_bytes_read = 0;
+    std::string last_word; // the word read before, to check the order
+    bool ok = false;
+
+    bool read(void *bytes, size_t size) {
+        ok = ok && fread(bytes, 1, size, file) == size;
+        return ok;
+    }
+
+    // Fails without reading the string if it is longer than max_size
+    bool read_string(std::string &str, uint64_t max_size) {
+        uint32_t size;
+        if(!read(&size, sizeof(size))) {
+            return false;
+        }
+        ok = size <= max_size;
+        if(!ok) {
+            return false;
+        }
+        str.resize(size);
+        return read(&str[0], size);
+    }
+
+    public:
+    Vocabulary labels; // the label table
+    std::vector<uint32_t> label_count;
+
+    // EFFECTS: opens path and reads the header and label table
+    explicit RunReader(const std::string &path) {
+        file = fopen(path.c_str(), "rb");
+        ok = file != nullptr && fseek(file, 0, SEEK_END) == 0;
+        if(ok) {
+            long size = ftell(file);
+            ok = size >= 0 && fseek(file, 0, SEEK_SET) == 0;
+            file_size = uint64_t(size);
+        }
+        if(!ok || !read(&header, sizeof(header))) {
+            return;
+        }
+        // Each word takes at least 8 bytes, and so does each posting
+        ok = memcmp(header.magic, "PZRUN002", 8) == 0 && header.byte_order == 0x01020304 &&
+            header.num_words <= file_size / 8 && header.num_postings <= file_size / 8 &&
+            header.word_bytes <= file_size;
+        std::string name;
+        for(uint32_t label = 0; ok && label < header.num_labels; label++) {
+            uint32_t count;
+            if(read_string(name, file_size) && read(&count, sizeof(count))) {
+                // Names are unique within a run, so IDs match the table
+                ok = labels.intern(name) == label;
+                label_count.push_back(count);
+            }
+        }
+    }
+
+    RunReader(const RunReader &) = delete;
+    RunReader &operator=(const RunReader &) = delete;
+
+    ~RunReader() {
+        if(file) {
+            fclose(file);
+        }
+    }
+
+    // RETURNS: true if the header and every word read so far were valid
+    bool good() const {
+        return ok;
+    }
+
+    uint64_t total_posts() const {
+        return header.total_posts;
+    }
+
+    uint64_t num_words() const {
+        return header.num_words;
+    }
+
+    uint64_t num_postings() const {
+        return header.num_postings;
+    }
+
+    uint64_t word_bytes() const {
+        return header.word_bytes;
+    }
+
+    // RETURNS: false at the end of the run or on a read error
+    // EFFECTS: reads the next word and its postings
+    // MODIFIES: word, postings
+    bool next(std::string &word, RunPostings &postings) {
+        if(ok && words_read == header.num_words) {
+            // The totals must add up to the header's
+            ok = postings_read == header.num_postings && word_bytes_read == header.word_bytes;
+            return false;
+        }
+        if(!ok || !read_string(word, header.word_bytes - word_bytes_read)) {
+            return false;
+        }
+        word_bytes_read += word.size();
+        ok = words_read == 0 || word > last_word;
+        last_word = word;
+        uint32_t size;
+        if(!ok || !read(&size, sizeof(size))) {
+            return false;
+        }
+        ok = size <= header.num_postings - postings_read;
+        if(!ok) {
+            return false;
+        }
+        postings_read += size;
+        postings.resize(size);
+        for(std::pair<uint32_t, uint32_t> &posting : postings) {
+            read(&posting.first, sizeof(uint32_t));
+            read(&posting.second, sizeof(uint32_t));
+            ok = ok && posting.first < header.num_labels;
+        }
+        words_read++;
+        return ok;
+    }
+};
+
+// RETURNS: true if the run was written
+// EFFECTS: writes counts to path as a run, with its labels in sorted order
+inline bool write_run(const std::string &path, const TrainingCounts &counts) {
+    std::vector<uint32_t> label_order = counts.labels.sorted_ids();
+    Vocabulary run_labels;
+    std::vector<uint32_t> run_label_count;
+    for(uint32_t label : label_order) {
+        run_labels.intern(counts.labels.name(label));
+        run_label_count.push_back(counts.label_count[label]);
+    }
+    // label_rank[label ID] = the label's index in the run's table
+    std::vector<uint32_t> label_rank(counts.labels.id_limit());
+    for(uint32_t rank = 0; rank < label_order.size(); rank++) {
+        label_rank[label_order[rank]] = rank;
+    }
+    std::vector<uint32_t> first;
+    RunPostings all_postings;
+    counts.word_postings(label_order, first, all_postings);
+
+    RunWriter out(path, run_labels, run_label_count, counts.total_posts);
+    RunPostings postings;
+    for(uint32_t word : counts.words.sorted_ids()) {
+        postings.clear();
+        for(uint32_t p = first[word]; p < first[word + 1]; p++) {
+            postings.emplace_back(label_rank[all_postings[p].first], all_postings[p].second);
+        }
+        out.add(counts.words.name(word), postings);
+    }
+    return out.close();
+}
+
+// RETURNS: true if the run was written
+// EFFECTS: writes the counts model was built from to path as a run
+inline bool write_run(const std::string &path, const Model &model) {
+    // Model IDs are already in sorted order
+    Vocabulary run_labels;
+    std::vector<uint32_t> run_label_count;
+    for(uint32_t label = 0; label < model.num_labels(); label++) {
+        run_labels.intern(model.label_name(label));
+        run_label_count.push_back(uint32_t(model.get_label_count(label)));
+    }
+    RunWriter out(path, run_labels, run_label_count, uint64_t(model.get_total_posts()));
+    RunPostings postings;
+    for(uint32_t word = 0; word < model.vocab_size(); word++) {
+        model.get_postings(word, postings);
+        out.add(model.word_name(word), postings);
+    }
+    return out.close();
+}
+
+// RETURNS: true if every input was read and the output was written
+// EFFECTS: merges the runs in inputs into one run at output, adding up the
+//          counts of labels and words that appear in several. Each input
+//          is read once, and only one word per input is held in memory.
+inline bool merge_runs(const std::vector<std::string> &inputs, const std::string &output) {
+    std::vector<std::unique_ptr<RunReader>> runs;
+    Vocabulary labels;
+    std::vector<uint32_t> label_count;
+    uint64_t total_posts = 0;
+    // label_ids[r][run label ID] = merged label ID
+    std::vector<std::vector<uint32_t>> label_ids;
+    for(const std::string &input : inputs) {
+        runs.emplace_back(new RunReader(input));
+        RunReader &run = *runs.back();
+        if(!run.good()) {
+            return false;
+        }
+        label_ids.emplace_back();
+        for(uint32_t label = 0; label < run.labels.id_limit(); label++) {
+            uint32_t id = labels.intern(run.labels.name(label));
+            if(id == label_count.size()) {
+                label_count.push_back(0);
+            }
+            label_count[id] += run.label_count[label];
+            label_ids.back().push_back(id);
+        }
+        total_posts += run.total_posts();
+    }
+
+    // Min-heap of the current word of every run that has words left
+    std::vector<std::string> words(runs.size());
+    std::vector<RunPostings> postings(runs.size());
+    auto later = [&words](size_t a, size_t b) {
+        return words[a] > words[b];
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(later);
+    for(size_t r = 0; r < runs.size(); r++) {
+        if(runs[r]->next(words[r], postings[r])) {
+            heap.push(r);
+        }
+    }
+
+    RunWriter out(output, labels, label_count, total_posts);
+    std::vector<uint32_t> sums(label_count.size(), 0);
+    std::vector<uint32_t> touched; // labels with a nonzero sum
+    RunPostings merged;
+    std::string word;
+    while(!heap.empty()) {
+        word = words[heap.top()];
+        // Take this word from every run that has it
+        while(!heap.empty() && words[heap.top()] == word) {
+            size_t r = heap.top();
+            heap.pop();
+            for(const std::pair<uint32_t, uint32_t> &posting : postings[r]) {
+                uint32_t label = label_ids[r][posting.first];
+                if(sums[label] == 0) {
+                    touched.push_back(label);
+                }
+                sums[label] += posting.second;
+            }
+            if(runs[r]->next(words[r], postings[r])) {
+                heap.push(r);
+            }
+        }
+        std::sort(touched.begin(), touched.end());
+        merged.clear();
+        for(uint32_t label : touched) {
+            merged.emplace_back(label, sums[label]);
+            sums[label] = 0;
+        }
+        touched.clear();
+        out.add(word, merged);
+    }
+    for(const std::unique_ptr<RunReader> &run : runs) {
+        if(!run->good()) {
+            return false;
+        }
+    }
+    return out.close();
+}
+
+// RETURNS: true if run_file held a valid run
+// EFFECTS: replaces model with one built from the counts in run_file, read
+//          one word at a time
+// MODIFIES: model
+inline bool build_model(const std::string &run_file, Model &model) {
+    RunReader run(run_file);
+    if(!run.good() || run.num_words() > UINT32_MAX || run.num_postings() > UINT32_MAX) {
+        return false;
+    }
+    return model.build(run.labels, run.label_count, run.total_posts(), 
+                       uint32_t(run.num_words()), uint32_t(run.num_postings()), 
+                       run.word_bytes(),
+                       [&run](std::string &word, RunPostings &postings) {
+                           return run.next(word, postings);
+                       }) && run.good();
+}
+
+// RETURNS: the path of a new empty temporary file for a run, in $TMPDIR or
+//          /tmp, or "" on failure
+inline std::string temp_run_file() {
+    const char *dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") + "/pzrun.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if(fd < 0) {
+        return "";
+    }
+    ::close(fd);
+    return path;
+}
+
+// RETURNS: true if every run was read and merged
+// EFFECTS: replaces model with the model of the counts in all of runs, as
+//          if they had been counted in one pass. Runs are merged at most
+//          max_fan_in at a time, so the open files stay bounded, into
+//          temporary runs that are removed once merged. The runs themselves
+//          are removed as they are merged only if remove_runs is set.
+// MODIFIES: model
+inline bool build_model(const std::vector<std::string> &runs, bool remove_runs, Model &model) {
+    const size_t max_fan_in = 64;
+    std::vector<std::string> pending(runs);
+    std::vector<bool> removable(runs.size(), remove_runs);
+    size_t next = 0; // runs before next are merged into later ones
+    bool ok = !runs.empty();
+    while(ok && pending.size() - next > 1) {
+        size_t end = std::min(next + max_fan_in, pending.size());
+        std::vector<std::string> inputs(pending.begin() + next, pending.begin() + end);
+        std::string merged = temp_run_file();
+        ok = !merged.empty() && merge_runs(inputs, merged);
+        // The inputs are not needed once they are merged
+        for(size_t i = next; i < end; i++) {
+            if(removable[i]) {
+                unlink(pending[i].c_str());
+            }
+        }
+        if(!merged.empty()) {
+            pending.push_back(merged);
+            removable.push_back(true);
+        }
+        next = end;
+    }
+    ok = ok && build_model(pending.back(), model);
+    if(!pending.empty() && removable.back()) {
+        unlink(pending.back().c_str());
+    }
+    return ok;
+}
+
+// Training counts that stay under a memory budget: posts are counted in
+// memory until the tables outgrow the budget, then the tables are spilled
+// to a temporary run file and counting starts over. finish() merges the
+// runs into the same model one pass in memory would have built.
+class SpillingCounts {
+    private:
+    TrainingCounts counts;
+    size_t budget_bytes;
+    std::vector<std::string> run_files; // temporary, removed by the destructor
+    bool ok = true;
+
+    // RETURNS: -
+    // EFFECTS: writes the counts to a new run and clears them
+    // MODIFIES: counts, run_files, ok
+    void spill() {
+        std::string path = temp_run_file();
+        if(!path.empty()) {
+            run_files.push_back(path);
+        }
+        ok = ok && !path.empty() && write_run(path, counts);
+        counts = TrainingCounts();
+    }
+
+    public:
+    explicit SpillingCounts(size_t budget_bytes_in) : budget_bytes(budget_bytes_in) {}
+
+    SpillingCounts(const SpillingCounts &) = delete;
+    SpillingCounts &operator=(const SpillingCounts &) = delete;
+
+    ~SpillingCounts() {
+        for(const std::string &path : run_files) {
+            unlink(path.c_str());
+        }
+    }
+
+    // RETURNS: false if a spill could not be written
+    // EFFECTS: counts one post, spilling the tables if they outgrow the budget
+    // MODIFIES: counts, run_files
+    bool add_post(std::string_view tag, const std::vector<std::string_view> &unique_words) {
+        counts.add_post(tag, unique_words);
+        if(counts.memory_bytes() > budget_bytes) {
+            spill();
+        }
+        return ok;
+    }
+
+    // RETURNS: false if a run could not be written or read back
+    // EFFECTS: replaces model with the model of every post counted. If
+    //          nothing was spilled it is built from memory; otherwise the
+    //          rest is spilled too and the runs are merged into the model.
+    // MODIFIES: counts, run_files, model
+    bool finish(Model &model) {
+        if(run_files.empty()) {
+            model = Model(counts);
+            counts = TrainingCounts();
+            return true;
+        }
+        if(counts.total_posts > 0) {
+            spill();
+        }
+        return ok && build_model(run_files, true, model);
+    }
+};
+
+#endif
@@ -0,0 +1,52 @@
+/* Splits post content into words without copying it. Words are returned as
+string_views into the original string, so they are only valid while that
+string is alive and unmodified. */
+
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <algorithm>
+#include <string_view>
+#include <vector>
+
+// RETURNS: true if c is whitespace in the "C" locale, which is what
+//          operator>>(istream&, string&) splits on by default
+inline bool is_word_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+        c == '\r';
+}
+
+// RETURNS: -
+// EFFECTS: appends each whitespace-delimited word of str to words, in order
+// MODIFIES: words
+inline void split_words(std::string_view str, std::vector<std::string_view> &words) {
+    const char *p = str.data();
+    const char *end = p + str.size();
+    while(p != end) {
+        while(p != end && is_word_space(*p)) {
+            ++p;
+        }
+        const char *start = p;
+        while(p != end && !is_word_space(*p)) {
+            ++p;
+        }
+        if(p != start) {
+            words.emplace_back(start, size_t(p - start));
+        }
+    }
+}
+
+// RETURNS: -
+// EFFECTS: replaces the contents of words with the unique words of str, sorted
+//          the way std::set<std::string> would iterate them. Reusing the same
+//          vector across calls means no allocation once it has grown to fit
+//          the longest post.
+// MODIFIES: words
+inline void split_unique_words(std::string_view str, std::vector<std::string_view> &words) {
+    words.clear();
+    split_words(str, words);
+    std::sort(words.begin(), words.end());
+    words.erase(std::unique(words.begin(), words.end()), words.end());
+}
+
+#endif
@@ -0,0 +1,344 @@
+/* Interns strings (words or labels) to dense uint32 IDs so the classifier can
+keep its counts in flat arrays indexed by ID instead of in string-keyed maps.
+Strings can be erased again, and their IDs are handed out to later strings,
+so the ID range only grows as far as the most strings alive at once.
+
+The strings themselves are packed back to back in large blocks instead of
+each living in its own heap allocation, so a vocabulary of millions of
+words is a few hundred blocks and is freed as such. Erased strings leave
+gaps in their blocks; once the gaps outgrow the strings in use, the live
+strings are repacked into fresh blocks.
+
+Strings are looked up in an open-addressing hash table of IDs. Its slots
+are split into groups of 16, each with 16 control bytes holding 7 bits of
+the hash of the string in each slot, so one SSE2 compare (or a short loop
+without SSE2) finds the few slots of a group worth checking, and a group
+with an empty slot ends the search. Each slot also keeps its string's
+length and first 8 bytes, so strings of up to 8 bytes are compared without
+reading the blocks at all and most other mismatches are rejected there. */
+
+#ifndef VOCABULARY_H
+#define VOCABULARY_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// RETURNS: a 64-bit hash of str, FNV-1a with a final avalanche so every
+//          bit depends on every byte
+inline uint64_t string_hash(std::string_view str) {
+    uint64_t hash = 14695981039346656037ull;
+    for(char c : str) {
+        hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+class Vocabulary {
+    private:
+    static constexpr size_t block_bytes = 1 << 16;
+    static constexpr size_t group_size = 16;
+    // Control bytes of slots without a string; any other control byte is
+    // the low 7 bits of the hash of the string in its slot
+    static constexpr uint8_t empty_slot = 0x80;
+    static constexpr uint8_t erased_slot = 0xFE; // may have been probed past
+    static constexpr size_t no_slot = SIZE_MAX;
+
+    struct Slot {
+        uint32_t id;
+        uint32_t length;
+        uint64_t prefix; // the first 8 bytes of the string, zero padded
+    };
+
+    // Own the bytes of the interned strings. Blocks never move, so the
+    // string_views in names stay valid as the vocabulary grows.
+    std::vector<std::unique_ptr<char[]>> blocks;
+    size_t block_used = block_bytes; // bytes used of blocks.back()
+    std::vector<std::string_view> names; // names[ID]: the string, in blocks
+    std::vector<uint8_t> control; // control[slot], a power of two of them
+    std::vector<Slot> slots;
+    size_t num_strings = 0; // strings interned and not erased
+    size_t num_erased_slots = 0;
+    std::vector<uint32_t> free_ids; // IDs of erased strings, reused first
+    size_t name_bytes = 0; // total length of the strings in use
+    size_t gap_bytes = 0; // total length of the erased strings still in blocks
+    size_t total_block_bytes = 0;
+
+    // RETURNS: a copy of str in the blocks
+    // EFFECTS: starts a new block if str does not fit in the last one;
+    //          strings longer than a block get a block of their own
+    // MODIFIES: blocks, block_used, total_block_bytes
+    std::string_view store(std::string_view str) {
+        if(str.empty()) {
+            return std::string_view("", 0);
+        }
+        if(str.size() > block_bytes) {
+            std::unique_ptr<char[]> own(new char[str.size()]);
+            char *copy = own.get();
+            memcpy(copy, str.data(), str.size());
+            // Kept before the last block, so that one can still be filled
+            blocks.insert(blocks.end() - !blocks.empty(), std::move(own));
+            total_block_bytes += str.size();
+            return std::string_view(copy, str.size());
+        }
+        if(block_bytes - block_used < str.size()) {
+            blocks.emplace_back(new char[block_bytes]);
+            block_used = 0;
+            total_block_bytes += block_bytes;
+        }
+        char *copy = blocks.back().get() + block_used;
+        memcpy(copy, str.data(), str.size());
+        block_used += str.size();
+        return std::string_view(copy, str.size());
+    }
+
+    // RETURNS: -
+    // EFFECTS: copies the strings in use into fresh blocks and frees the old
+    //          ones, dropping the gaps erased strings left
+    // MODIFIES: blocks, block_used, names, gap_bytes
+    void repack() {
+        std::vector<std::unique_ptr<char[]>> old_blocks;
+        old_blocks.swap(blocks);
+        block_used = block_bytes;
+        total_block_bytes = 0;
+        for(size_t slot = 0; slot < slots.size(); slot++) {
+            if(!(control[slot] & 0x80)) {
+                names[slots[slot].id] = store(names[slots[slot].id]);
+            }
+        }
+        gap_bytes = 0;
+    }
+
+    // RETURNS: the first 8 bytes of str, zero padded
+    static uint64_t prefix_of(std::string_view str) {
+        uint64_t prefix = 0;
+        if(!str.empty()) {
+            memcpy(&prefix, str.data(), std::min(str.size(), sizeof(prefix)));
+        }
+        return prefix;
+    }
+
+    // RETURNS: a bit mask of the control bytes in group equal to byte
+    static uint32_t match_group(const uint8_t *group, uint8_t byte) {
+#if defined(__SSE2__)
+        __m128i bytes = _mm_loadu_si128((const __m128i *)group);
+        return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(char(byte)))));
+#else
+        uint32_t mask = 0;
+        for(size_t i = 0; i < group_size; i++) {
+            mask |= uint32_t(group[i] == byte) << i;
+        }
+        return mask;
+#endif
+    }
+
+    // RETURNS: a bit mask of the slots in group without a string
+    static uint32_t match_free(const uint8_t *group) {
+#if defined(__SSE2__)
+        return uint32_t(_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group)));
+#else
+        uint32_t mask = 0;
+        for(size_t i = 0; i < group_size; i++) {
+            mask |= uint32_t(group[i] >> 7) << i;
+        }
+        return mask;
+#endif
+    }
+
+    // RETURNS: the slot holding str, whose hash is hash, or no_slot
+    // EFFECTS: -
+    // MODIFIES: -
+    size_t find_slot(std::string_view str, uint64_t hash) const {
+        if(control.empty()) {
+            return no_slot;
+        }
+        size_t group_mask = control.size() / group_size - 1;
+        uint8_t tag = uint8_t(hash & 0x7F);
+        uint64_t prefix = prefix_of(str);
+        // Triangular steps over a power of two of groups visit every group
+        size_t group = (hash >> 7) & group_mask;
+        for(size_t step = 1; ; step++) {
+            const uint8_t *group_control = &control[group * group_size];
+            for(uint32_t hits = match_group(group_control, tag); hits != 0; hits &= hits - 1) {
+                size_t slot = group * group_size + __builtin_ctz(hits);
+                const Slot &entry = slots[slot];
+                if(entry.length == str.size() && entry.prefix == prefix &&
+                   (str.size() <= sizeof(prefix) ||
+                    memcmp(names[entry.id].data() + sizeof(prefix), str.data() + sizeof(prefix),
+                           str.size() - sizeof(prefix)) == 0)) {
+                    return slot;
+                }
+            }
+            if(match_group(group_control, empty_slot) != 0) {
+                return no_slot;
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+
+    // RETURNS: -
+    // REQUIRES: the table has a free slot and no slot holds this string
+    // EFFECTS: puts entry, of a string whose hash is hash, in the first free
+    //          slot on its probe sequence
+    // MODIFIES: control, slots, num_erased_slots
+    void place(uint64_t hash, const Slot &entry) {
+        size_t group_mask = control.size() / group_size - 1;
+        size_t group = (hash >> 7) & group_mask;
+        for(size_t step = 1; ; step++) {
+            uint32_t free = match_free(&control[group * group_size]);
+            if(free != 0) {
+                size_t slot = group * group_size + __builtin_ctz(free);
+                num_erased_slots -= control[slot] == erased_slot;
+                control[slot] = uint8_t(hash & 0x7F);
+                slots[slot] = entry;
+                return;
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+
+    // RETURNS: -
+    // EFFECTS: rebuilds the table without erased slots, doubling it if
+    //          more than 7/16 of it would be in use afterwards
+    // MODIFIES: control, slots, num_erased_slots
+    void rehash() {
+        size_t capacity = control.size();
+        if((num_strings + 1) * 16 > capacity * 7) {
+            capacity = std::max(group_size, capacity * 2);
+        }
+        std::vector<uint8_t> old_control = std::move(control);
+        std::vector<Slot> old_slots = std::move(slots);
+        control.assign(capacity, empty_slot);
+        slots.assign(capacity, Slot());
+        num_erased_slots = 0;
+        for(size_t slot = 0; slot < old_slots.size(); slot++) {
+            if(!(old_control[slot] & 0x80)) {
+                place(string_hash(names[old_slots[slot].id]), old_slots[slot]);
+            }
+        }
+    }
+
+    public:
+    // Returned by find() for strings that were never interned
+    static constexpr uint32_t npos = UINT32_MAX;
+
+    // RETURNS: the ID of str, assigning an erased or the next unused ID if
+    //          str is new
+    // EFFECTS: -
+    // MODIFIES: blocks, names, control, slots, free_ids
+    uint32_t intern(std::string_view str) {
+        uint64_t hash = string_hash(str);
+        size_t found = find_slot(str, hash);
+        if(found != no_slot) {
+            return slots[found].id;
+        }
+        // Keep at least 1/8 of the slots empty, so every search ends
+        if((num_strings + num_erased_slots + 1) * 8 > control.size() * 7) {
+            rehash();
+        }
+        uint32_t id;
+        if(!free_ids.empty()) {
+            id = free_ids.back();
+            free_ids.pop_back();
+            names[id] = store(str);
+        }
+        else {
+            id = uint32_t(names.size());
+            names.push_back(store(str));
+        }
+        name_bytes += str.size();
+        place(hash, Slot{id, uint32_t(str.size()), prefix_of(str)});
+        num_strings++;
+        return id;
+    }
+
+    // RETURNS: -
+    // REQUIRES: id is in use
+    // EFFECTS: forgets the string interned as id and frees id for reuse,
+    //          repacking the strings if the gaps outgrow them
+    // MODIFIES: blocks, names, control, free_ids
+    void erase(uint32_t id) {
+        size_t slot = find_slot(names[id], string_hash(names[id]));
+        // A probe only passes through a group once it is full, so if this
+        // group still has an empty slot no search needs this one kept
+        if(match_group(&control[slot / group_size * group_size], empty_slot) != 0) {
+            control[slot] = empty_slot;
+        }
+        else {
+            control[slot] = erased_slot;
+            num_erased_slots++;
+        }
+        num_strings--;
+        name_bytes -= names[id].size();
+        gap_bytes += names[id].size();
+        names[id] = std::string_view();
+        free_ids.push_back(id);
+        if(gap_bytes > block_bytes && gap_bytes > name_bytes) {
+            repack();
+        }
+    }
+
+    // RETURNS: the ID of str, or npos if str was never interned
+    // EFFECTS: -
+    // MODIFIES: -
+    uint32_t find(std::string_view str) const {
+        size_t slot = find_slot(str, string_hash(str));
+        return slot == no_slot ? npos : slots[slot].id;
+    }
+
+    // RETURNS: the string interned as id
+    std::string_view name(uint32_t id) const {
+        return names[id];
+    }
+
+    // RETURNS: the number of strings interned and not erased
+    size_t size() const {
+        return num_strings;
+    }
+
+    // RETURNS: one more than the largest ID ever handed out, for sizing
+    //          tables indexed by ID
+    size_t id_limit() const {
+        return names.size();
+    }
+
+    // RETURNS: an estimate of the heap memory held, counting the blocks,
+    //          names and the hash table
+    size_t memory_bytes() const {
+        return total_block_bytes + blocks.capacity() * sizeof(blocks[0]) +
+            names.capacity() * sizeof(std::string_view) + control.capacity() +
+            slots.capacity() * sizeof(Slot) + free_ids.capacity() * sizeof(uint32_t);
+    }
+
+    // RETURNS: every ID in use, ordered by its string the same way
+    //          std::map<string,...> would iterate them
+    // EFFECTS: -
+    // MODIFIES: -
+    std::vector<uint32_t> sorted_ids() const {
+        std::vector<uint32_t> order;
+        order.reserve(num_strings);
+        for(size_t slot = 0; slot < slots.size(); slot++) {
+            if(!(control[slot] & 0x80)) {
+                order.push_back(slots[slot].id);
+            }
+        }
+        std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+            return names[a] < names[b];
+        });
+        return order;
+    }
+};
+
+#endif